@@ -1,12 +1,36 @@
+#define _GNU_SOURCE  // fseeko(), vmsplice(), F_SETPIPE_SZ
+#define _FILE_OFFSET_BITS 64
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_X86 1
+#  include <immintrin.h>
+#endif
+
+#include "font.h"
+
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#  define fseeko _fseeki64
+#  define ftello _ftelli64
+#endif
+
 
 #define S     800           // video size
 #define N     360           // number of dots
@@ -19,6 +43,15 @@
 #define MINHZ 20            // lowest tone
 #define MAXHZ 1000          // highest tone
 #define PI 3.141592653589793f
+#define SUBPX 16            // dot sprite subpixel resolution
+#define DOT_R (S / 200 + 1) // dot sprite radius in whole pixels
+#define DOT_W (DOT_R * 2 + 1)
+#define TILE  64            // tile size for threaded rendering
+#define TILES ((S + TILE - 1) / TILE)
+#define BAND_BYTES (256 * 1024)  // band buffer size for streaming output
+#define BAND  (BAND_BYTES / (S * 6) ? BAND_BYTES / (S * 6) * 2 : 2)  // even
+#define BANDS ((S + BAND - 1) / BAND)
+#define BINS_MAX (TILES * TILES > BANDS ? TILES * TILES : BANDS)
 
 static uint32_t
 pcg32(uint64_t *s)
@@ -31,243 +64,3024 @@ pcg32(uint64_t *s)
 }
 
 static void
-emit_u32le(unsigned long v, FILE *f)
+emit_u32le(unsigned long v, FILE *f)
+{
+    fputc((v >>  0) & 0xff, f);
+    fputc((v >>  8) & 0xff, f);
+    fputc((v >> 16) & 0xff, f);
+    fputc((v >> 24) & 0xff, f);
+}
+
+static void
+emit_u32be(unsigned long v, FILE *f)
+{
+    fputc((v >> 24) & 0xff, f);
+    fputc((v >> 16) & 0xff, f);
+    fputc((v >>  8) & 0xff, f);
+    fputc((v >>  0) & 0xff, f);
+}
+
+static void
+emit_u16le(unsigned v, FILE *f)
+{
+    fputc((v >> 0) & 0xff, f);
+    fputc((v >> 8) & 0xff, f);
+}
+
+static float
+clamp(float x, float lower, float upper)
+{
+    if (x < lower)
+        return lower;
+    if (x > upper)
+        return upper;
+    return x;
+}
+
+static float
+smoothstep(float lower, float upper, float x)
+{
+    x = clamp((x - lower) / (upper - lower), 0.0f, 1.0f);
+    return x * x * (3.0f - 2.0f * x);
+}
+
+/* Blend two 8-bit channel values with 8-bit alpha, rounding to nearest.
+ * The intermediate never exceeds 16 bits.
+ */
+static int
+blend(int bg, int fg, int a)
+{
+    int t = fg * a + bg * (255 - a) + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+/* Row blend kernels: composite n bytes of fg over dst, where alpha holds
+ * one 8-bit alpha per byte (i.e. each pixel's alpha repeated 3 times).
+ * All variants produce identical output to blend().
+ */
+static void
+blend_row_generic(unsigned char *dst, const unsigned char *fg,
+                  const unsigned char *alpha, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = blend(dst[i], fg[i], alpha[i]);
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static __m128i
+blend_epi16_sse2(__m128i d, __m128i f, __m128i a)
+{
+    __m128i ia = _mm_xor_si128(a, _mm_set1_epi16(0xff));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(f, a), _mm_mullo_epi16(d, ia));
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void
+blend_row_sse2(unsigned char *dst, const unsigned char *fg,
+               const unsigned char *alpha, int n)
+{
+    __m128i z = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_loadu_si128((void *)(dst + i));
+        __m128i f = _mm_loadu_si128((void *)(fg + i));
+        __m128i a = _mm_loadu_si128((void *)(alpha + i));
+        __m128i lo = blend_epi16_sse2(_mm_unpacklo_epi8(d, z),
+                                      _mm_unpacklo_epi8(f, z),
+                                      _mm_unpacklo_epi8(a, z));
+        __m128i hi = blend_epi16_sse2(_mm_unpackhi_epi8(d, z),
+                                      _mm_unpackhi_epi8(f, z),
+                                      _mm_unpackhi_epi8(a, z));
+        _mm_storeu_si128((void *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blend_row_generic(dst + i, fg + i, alpha + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static __m128i
+load_epu8_sse41(const unsigned char *p)
+{
+    return _mm_cvtepu8_epi16(_mm_loadl_epi64((void *)p));
+}
+
+__attribute__((target("sse4.1")))
+static void
+blend_row_sse41(unsigned char *dst, const unsigned char *fg,
+                const unsigned char *alpha, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo = blend_epi16_sse2(load_epu8_sse41(dst + i),
+                                      load_epu8_sse41(fg + i),
+                                      load_epu8_sse41(alpha + i));
+        __m128i hi = blend_epi16_sse2(load_epu8_sse41(dst + i + 8),
+                                      load_epu8_sse41(fg + i + 8),
+                                      load_epu8_sse41(alpha + i + 8));
+        _mm_storeu_si128((void *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blend_row_generic(dst + i, fg + i, alpha + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static __m256i
+blend_epi16_avx2(const unsigned char *d, const unsigned char *f,
+                 const unsigned char *a)
+{
+    __m256i vd = _mm256_cvtepu8_epi16(_mm_loadu_si128((void *)d));
+    __m256i vf = _mm256_cvtepu8_epi16(_mm_loadu_si128((void *)f));
+    __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((void *)a));
+    __m256i ia = _mm256_xor_si256(va, _mm256_set1_epi16(0xff));
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(vf, va),
+                                 _mm256_mullo_epi16(vd, ia));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void
+blend_row_avx2(unsigned char *dst, const unsigned char *fg,
+               const unsigned char *alpha, int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i lo = blend_epi16_avx2(dst + i, fg + i, alpha + i);
+        __m256i hi = blend_epi16_avx2(dst + i + 16, fg + i + 16,
+                                      alpha + i + 16);
+        __m256i r = _mm256_packus_epi16(lo, hi);
+        r = _mm256_permute4x64_epi64(r, 0xd8);
+        _mm256_storeu_si256((void *)(dst + i), r);
+    }
+    _mm256_zeroupper();  // avoid AVX/SSE transition penalties
+    blend_row_sse41(dst + i, fg + i, alpha + i, n - i);
+}
+#endif
+
+/* Color conversion kernels: convert n RGB pixels to BT.601 limited-range
+ * Y, U and V, one full-resolution plane row each.
+ */
+static void
+yuv_row_generic(const unsigned char *rgb, unsigned char *y,
+                unsigned char *u, unsigned char *v, int n)
+{
+    for (int i = 0; i < n; i++) {
+        int r = rgb[i * 3 + 0];
+        int g = rgb[i * 3 + 1];
+        int b = rgb[i * 3 + 2];
+        y[i] = ((  66 * r + 129 * g +  25 * b + 128) >> 8) +  16;
+        u[i] = (( -38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+        v[i] = (( 112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+    }
+}
+
+/* Average 2x2 blocks of rows a and b (each w bytes wide) into one row
+ * of (w + 1) / 2 bytes, for 4:2:0 chroma.
+ */
+static void
+half_row_generic(const unsigned char *a, const unsigned char *b,
+                 unsigned char *dst, int w)
+{
+    for (int i = 0; i < (w + 1) / 2; i++) {
+        int j = i * 2 + 1 < w ? i * 2 + 1 : i * 2;
+        dst[i] = (a[i * 2] + a[j] + b[i * 2] + b[j] + 2) >> 2;
+    }
+}
+
+/* Swizzle n packed RGB pixels into opaque BGRA. */
+static void
+bgra_row_generic(const unsigned char *rgb, unsigned char *bgra, int n)
+{
+    for (int i = 0; i < n; i++) {
+        bgra[i * 4 + 0] = rgb[i * 3 + 2];
+        bgra[i * 4 + 1] = rgb[i * 3 + 1];
+        bgra[i * 4 + 2] = rgb[i * 3 + 0];
+        bgra[i * 4 + 3] = 255;
+    }
+}
+
+#ifdef HAVE_X86
+/* pshufb masks splitting 16 packed RGB pixels (48 bytes, loaded as three
+ * vectors) into one channel each.
+ */
+static const signed char rgb_split_masks[3][3][16] = {
+    {
+        { 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13},
+    },
+    {
+        { 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14},
+    },
+    {
+        { 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15},
+    },
+};
+
+__attribute__((target("ssse3")))
+static __m128i
+rgb_split_ssse3(__m128i a, __m128i b, __m128i c, int ch)
+{
+    const __m128i *m = (const __m128i *)rgb_split_masks[ch];
+    __m128i x = _mm_shuffle_epi8(a, _mm_loadu_si128(m + 0));
+    __m128i y = _mm_shuffle_epi8(b, _mm_loadu_si128(m + 1));
+    __m128i z = _mm_shuffle_epi8(c, _mm_loadu_si128(m + 2));
+    return _mm_or_si128(_mm_or_si128(x, y), z);
+}
+
+/* One channel of the conversion on 16-bit lanes. The Y sum (bias 16)
+ * needs all 16 bits unsigned, while U and V (bias 128) are signed.
+ */
+__attribute__((target("ssse3")))
+static __m128i
+yuv_epi16_ssse3(__m128i r, __m128i g, __m128i b,
+                int kr, int kg, int kb, int bias)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+    t = _mm_add_epi16(t, _mm_mullo_epi16(b, _mm_set1_epi16(kb)));
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    t = bias == 16 ? _mm_srli_epi16(t, 8) : _mm_srai_epi16(t, 8);
+    return _mm_add_epi16(t, _mm_set1_epi16(bias));
+}
+
+__attribute__((target("ssse3")))
+static void
+yuv_row_ssse3(const unsigned char *rgb, unsigned char *y,
+              unsigned char *u, unsigned char *v, int n)
+{
+    __m128i z = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((void *)(rgb + i * 3 +  0));
+        __m128i b = _mm_loadu_si128((void *)(rgb + i * 3 + 16));
+        __m128i c = _mm_loadu_si128((void *)(rgb + i * 3 + 32));
+        __m128i r8 = rgb_split_ssse3(a, b, c, 0);
+        __m128i g8 = rgb_split_ssse3(a, b, c, 1);
+        __m128i b8 = rgb_split_ssse3(a, b, c, 2);
+        __m128i rl = _mm_unpacklo_epi8(r8, z), rh = _mm_unpackhi_epi8(r8, z);
+        __m128i gl = _mm_unpacklo_epi8(g8, z), gh = _mm_unpackhi_epi8(g8, z);
+        __m128i bl = _mm_unpacklo_epi8(b8, z), bh = _mm_unpackhi_epi8(b8, z);
+        _mm_storeu_si128((void *)(y + i), _mm_packus_epi16(
+            yuv_epi16_ssse3(rl, gl, bl,  66, 129,  25,  16),
+            yuv_epi16_ssse3(rh, gh, bh,  66, 129,  25,  16)));
+        _mm_storeu_si128((void *)(u + i), _mm_packus_epi16(
+            yuv_epi16_ssse3(rl, gl, bl, -38, -74, 112, 128),
+            yuv_epi16_ssse3(rh, gh, bh, -38, -74, 112, 128)));
+        _mm_storeu_si128((void *)(v + i), _mm_packus_epi16(
+            yuv_epi16_ssse3(rl, gl, bl, 112, -94, -18, 128),
+            yuv_epi16_ssse3(rh, gh, bh, 112, -94, -18, 128)));
+    }
+    yuv_row_generic(rgb + i * 3, y + i, u + i, v + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static __m128i
+yuv_epi16_avx2(__m256i r, __m256i g, __m256i b,
+               int kr, int kg, int kb, int bias)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(kr)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(kg)));
+    t = _mm256_add_epi16(t, _mm256_mullo_epi16(b, _mm256_set1_epi16(kb)));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    t = bias == 16 ? _mm256_srli_epi16(t, 8) : _mm256_srai_epi16(t, 8);
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(bias));
+    return _mm_packus_epi16(_mm256_castsi256_si128(t),
+                            _mm256_extracti128_si256(t, 1));
+}
+
+__attribute__((target("avx2")))
+static void
+yuv_row_avx2(const unsigned char *rgb, unsigned char *y,
+             unsigned char *u, unsigned char *v, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((void *)(rgb + i * 3 +  0));
+        __m128i b = _mm_loadu_si128((void *)(rgb + i * 3 + 16));
+        __m128i c = _mm_loadu_si128((void *)(rgb + i * 3 + 32));
+        __m256i r16 = _mm256_cvtepu8_epi16(rgb_split_ssse3(a, b, c, 0));
+        __m256i g16 = _mm256_cvtepu8_epi16(rgb_split_ssse3(a, b, c, 1));
+        __m256i b16 = _mm256_cvtepu8_epi16(rgb_split_ssse3(a, b, c, 2));
+        _mm_storeu_si128((void *)(y + i),
+                         yuv_epi16_avx2(r16, g16, b16,  66, 129,  25,  16));
+        _mm_storeu_si128((void *)(u + i),
+                         yuv_epi16_avx2(r16, g16, b16, -38, -74, 112, 128));
+        _mm_storeu_si128((void *)(v + i),
+                         yuv_epi16_avx2(r16, g16, b16, 112, -94, -18, 128));
+    }
+    _mm256_zeroupper();
+    yuv_row_generic(rgb + i * 3, y + i, u + i, v + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+half_row_sse2(const unsigned char *a, const unsigned char *b,
+              unsigned char *dst, int w)
+{
+    __m128i lo = _mm_set1_epi16(0xff);
+    __m128i two = _mm_set1_epi16(2);
+    int i = 0;
+    for (; i + 32 <= w; i += 32) {
+        __m128i s[2];
+        for (int k = 0; k < 2; k++) {
+            __m128i x = _mm_loadu_si128((void *)(a + i + k * 16));
+            __m128i y = _mm_loadu_si128((void *)(b + i + k * 16));
+            __m128i t = _mm_and_si128(x, lo);
+            t = _mm_add_epi16(t, _mm_srli_epi16(x, 8));
+            t = _mm_add_epi16(t, _mm_and_si128(y, lo));
+            t = _mm_add_epi16(t, _mm_srli_epi16(y, 8));
+            s[k] = _mm_srli_epi16(_mm_add_epi16(t, two), 2);
+        }
+        _mm_storeu_si128((void *)(dst + i / 2), _mm_packus_epi16(s[0], s[1]));
+    }
+    half_row_generic(a + i, b + i, dst + i / 2, w - i);
+}
+
+__attribute__((target("ssse3")))
+static void
+bgra_row_ssse3(const unsigned char *rgb, unsigned char *bgra, int n)
+{
+    __m128i shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                 8, 7, 6, -1, 11, 10, 9, -1);
+    __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i = 0;
+    /* Each load covers 16 bytes but only 4 pixels are used */
+    for (; i + 6 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((void *)(rgb + i * 3));
+        x = _mm_or_si128(_mm_shuffle_epi8(x, shuf), alpha);
+        _mm_storeu_si128((void *)(bgra + i * 4), x);
+    }
+    bgra_row_generic(rgb + i * 3, bgra + i * 4, n - i);
+}
+#endif
+
+/* Audio kernels: accumulate n samples of a voice scaled by w, and
+ * convert n float samples to 16-bit little endian PCM, saturating
+ * rather than wrapping around when out of range.
+ */
+static void
+mix_row_generic(float *acc, const float *v, float w, int n)
+{
+    for (int i = 0; i < n; i++)
+        acc[i] += w * v[i];
+}
+
+static void
+pcm_row_generic(const float *samples, unsigned char *pcm, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float x = samples[i] * 0x7fff;
+        int s = x < -0x8000 ? -0x8000 : x > 0x7fff ? 0x7fff : (int)x;
+        pcm[i * 2 + 0] = s >> 0;
+        pcm[i * 2 + 1] = s >> 8;
+    }
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void
+mix_row_avx2(float *acc, const float *v, float w, int n)
+{
+    __m256 vw = _mm256_set1_ps(w);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 a = _mm256_loadu_ps(acc + i);
+        a = _mm256_add_ps(a, _mm256_mul_ps(vw, _mm256_loadu_ps(v + i)));
+        _mm256_storeu_ps(acc + i, a);
+    }
+    _mm256_zeroupper();
+    mix_row_generic(acc + i, v + i, w, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+pcm_row_sse2(const float *samples, unsigned char *pcm, int n)
+{
+    __m128 scale = _mm_set1_ps(0x7fff);
+    __m128 lo = _mm_set1_ps(-0x8000);
+    __m128 hi = _mm_set1_ps(0x7fff);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(samples + i + 0), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(samples + i + 4), scale);
+        a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+        b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+        __m128i s = _mm_packs_epi32(_mm_cvttps_epi32(a),
+                                    _mm_cvttps_epi32(b));
+        _mm_storeu_si128((void *)(pcm + i * 2), s);
+    }
+    pcm_row_generic(samples + i, pcm + i * 2, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+pcm_row_avx2(const float *samples, unsigned char *pcm, int n)
+{
+    __m256 scale = _mm256_set1_ps(0x7fff);
+    __m256 lo = _mm256_set1_ps(-0x8000);
+    __m256 hi = _mm256_set1_ps(0x7fff);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(samples + i + 0), scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(samples + i + 8), scale);
+        a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+        b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+        __m256i s = _mm256_packs_epi32(_mm256_cvttps_epi32(a),
+                                       _mm256_cvttps_epi32(b));
+        s = _mm256_permute4x64_epi64(s, 0xd8);
+        _mm256_storeu_si256((void *)(pcm + i * 2), s);
+    }
+    _mm256_zeroupper();
+    pcm_row_sse2(samples + i, pcm + i * 2, n - i);
+}
+#endif
+
+static void (*blend_row)(unsigned char *, const unsigned char *,
+                         const unsigned char *, int) = blend_row_generic;
+static void (*yuv_row)(const unsigned char *, unsigned char *,
+                       unsigned char *, unsigned char *, int)
+    = yuv_row_generic;
+static void (*half_row)(const unsigned char *, const unsigned char *,
+                        unsigned char *, int) = half_row_generic;
+static void (*bgra_row)(const unsigned char *, unsigned char *, int)
+    = bgra_row_generic;
+static void (*mix_row)(float *, const float *, float, int) = mix_row_generic;
+static void (*pcm_row)(const float *, unsigned char *, int)
+    = pcm_row_generic;
+
+/* Select the widest kernels supported by the running CPU. */
+static void
+simd_init(void)
+{
+    #ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        blend_row = blend_row_avx2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        blend_row = blend_row_sse41;
+    else if (__builtin_cpu_supports("sse2"))
+        blend_row = blend_row_sse2;
+
+    if (__builtin_cpu_supports("avx2"))
+        yuv_row = yuv_row_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        yuv_row = yuv_row_ssse3;
+
+    if (__builtin_cpu_supports("sse2"))
+        half_row = half_row_sse2;
+
+    if (__builtin_cpu_supports("ssse3"))
+        bgra_row = bgra_row_ssse3;
+
+    if (__builtin_cpu_supports("avx2"))
+        mix_row = mix_row_avx2;
+
+    if (__builtin_cpu_supports("avx2"))
+        pcm_row = pcm_row_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        pcm_row = pcm_row_sse2;
+    #endif
+}
+
+/* Font atlas for characters 32 to 127, gamma corrected to 8-bit alpha. */
+static unsigned char glyphs[96][FONT_H][FONT_W];
+
+static void
+font_init(void)
+{
+    for (int c = 0; c < 96; c++) {
+        int cx = (c + 32) % 16;
+        int cy = c / 16;
+        for (int y = 0; y < FONT_H; y++) {
+            const unsigned char *row = font + (cy * FONT_H + y) * FONT_W * 16;
+            for (int x = 0; x < FONT_W; x++) {
+                int v = row[cx * FONT_W + x];
+                glyphs[c][y][x] = sqrtf(v / 255.0f) * 255.0f + 0.5f;
+            }
+        }
+    }
+}
+
+/* Format a header into buf, returning its length (under 64 bytes). */
+static int
+ppm_header(char *buf)
+{
+    return sprintf(buf, "P6\n%d %d\n255\n", S, S);
+}
+
+static int
+y4m_header(char *buf, const char *chroma)
+{
+    return sprintf(buf, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C%s\n",
+                   S, S, FPS, chroma);
+}
+
+/* Fill a row with n pixels of a 24-bit color. */
+static void
+color_row(unsigned char *row, unsigned long color, int n)
+{
+    for (int i = 0; i < n; i++) {
+        row[i * 3 + 0] = color >> 16;
+        row[i * 3 + 1] = color >>  8;
+        row[i * 3 + 2] = color >>  0;
+    }
+}
+
+/* Half-open pixel rectangle. */
+struct rect {
+    int x0, y0, x1, y1;
+};
+
+static struct rect
+rect_intersect(struct rect a, struct rect b)
+{
+    struct rect r = {
+        a.x0 > b.x0 ? a.x0 : b.x0,
+        a.y0 > b.y0 ? a.y0 : b.y0,
+        a.x1 < b.x1 ? a.x1 : b.x1,
+        a.y1 < b.y1 ? a.y1 : b.y1,
+    };
+    return r;
+}
+
+static int
+rect_empty(struct rect r)
+{
+    return r.x0 >= r.x1 || r.y0 >= r.y1;
+}
+
+/* Grow a rectangle to a multiple of 1 << shift, within the screen. */
+static struct rect
+rect_align(struct rect r, int shift)
+{
+    int m = (1 << shift) - 1;
+    struct rect a = {r.x0 & ~m, r.y0 & ~m, (r.x1 + m) & ~m, (r.y1 + m) & ~m};
+    struct rect screen = {0, 0, S, S};
+    return rect_intersect(a, screen);
+}
+
+/* Dot alpha masks sampled on a grid of subpixel center offsets, in
+ * fixed point with 8 fractional bits (255 << 8 is fully opaque).
+ */
+static unsigned short dot_sprites[SUBPX + 1][SUBPX + 1][DOT_W * DOT_W];
+
+static void
+dot_init(void)
+{
+    for (int sy = 0; sy <= SUBPX; sy++) {
+        for (int sx = 0; sx <= SUBPX; sx++) {
+            unsigned short *sprite = dot_sprites[sy][sx];
+            for (int py = 0; py < DOT_W; py++) {
+                float dy = py - DOT_R - sy / (float)SUBPX;
+                for (int px = 0; px < DOT_W; px++) {
+                    float dx = px - DOT_R - sx / (float)SUBPX;
+                    float d = sqrtf(dy * dy + dx * dx);
+                    float a = smoothstep(R1, R0, d);
+                    sprite[py * DOT_W + px] = roundf(a * (255 << 8));
+                }
+            }
+        }
+    }
+}
+
+/* Where a dot lands on the pixel grid: the whole pixel containing its
+ * center, the cached mask cell around its fractional offset, and the
+ * 8-bit interpolation weights within that cell.
+ */
+struct place {
+    short x, y;
+    unsigned char sx, sy;
+    unsigned char wx, wy;
+};
+
+static struct place
+dot_place(float x, float y)
+{
+    struct place p;
+    p.x = floorf(x);
+    p.y = floorf(y);
+    int ux = (x - p.x) * (SUBPX << 8);
+    int uy = (y - p.y) * (SUBPX << 8);
+    p.sx = ux >> 8;
+    p.wx = ux & 0xff;
+    p.sy = uy >> 8;
+    p.wy = uy & 0xff;
+    return p;
+}
+
+/* Build the 8-bit alpha mask for a placed dot by interpolating between
+ * the four nearest cached masks. Each alpha is written n times, once
+ * per interleaved color channel.
+ */
+static void
+dot_mask(unsigned char *mask, struct place p, int n)
+{
+    int wx = p.wx;
+    int wy = p.wy;
+    const unsigned short *s00 = dot_sprites[p.sy + 0][p.sx + 0];
+    const unsigned short *s01 = dot_sprites[p.sy + 0][p.sx + 1];
+    const unsigned short *s10 = dot_sprites[p.sy + 1][p.sx + 0];
+    const unsigned short *s11 = dot_sprites[p.sy + 1][p.sx + 1];
+    for (int i = 0; i < DOT_W * DOT_W; i++) {
+        int a0 = (s00[i] * 256 + wx * (s01[i] - s00[i]) + 128) >> 8;
+        int a1 = (s10[i] * 256 + wx * (s11[i] - s10[i]) + 128) >> 8;
+        int a = a0 * 256 + wy * (a1 - a0);
+        memset(mask + i * n, (a + (1 << 15)) >> 16, n);
+    }
+}
+
+/* Pixel bounds of a placed dot. */
+static struct rect
+dot_bounds(struct place p)
+{
+    struct rect r = {
+        p.x - DOT_R, p.y - DOT_R, p.x + DOT_R + 1, p.y + DOT_R + 1
+    };
+    return r;
+}
+
+/* Draw a dot, touching only the pixels inside clip. The color is given
+ * as a row of DOT_W pixels, and the buffer holds full-width rows of the
+ * screen starting at row clip.y0.
+ *
+ * Compared to exact float compositing, each dot's 8-bit alpha and each
+ * rounded blend can be off by up to about half a step, and these add up
+ * where dots overlap. A pixel is usually within 1, but where two or
+ * three dot edges meet it can be off by 2 or, rarely, 3.
+ */
+static void
+ppm_dot(unsigned char *buf, struct place p, const unsigned char *color,
+        struct rect clip)
+{
+    struct rect b = dot_bounds(p);
+    struct rect r = rect_intersect(b, clip);
+    if (rect_empty(r))
+        return;
+
+    unsigned char mask[DOT_W * DOT_W * 3];
+    dot_mask(mask, p, 3);
+
+    for (int py = r.y0; py < r.y1; py++) {
+        int my = py - b.y0;
+        int mx = r.x0 - b.x0;
+        unsigned char *dst = buf + (py - clip.y0) * S * 3 + r.x0 * 3;
+        blend_row(dst, color, mask + (my * DOT_W + mx) * 3, (r.x1 - r.x0) * 3);
+    }
+}
+
+/* A message overlay, rendered once into a strip of per-byte alpha the
+ * first time the message is shown.
+ */
+struct text {
+    const char *message;
+    struct rect bounds;
+    unsigned char *alpha;   // per byte of packed RGB
+    unsigned char *color;   // packed RGB row
+    unsigned char *mask;    // one alpha per pixel, for YUV planes
+    unsigned char *yuv[3];  // Y, U and V rows
+    struct text *next;
+};
+
+/* Return the overlay for a message, creating it if needed. Overlays
+ * are never freed, as there are only a handful of distinct messages.
+ */
+static const struct text *
+text_get(const char *message)
+{
+    static struct text *texts;
+    if (!message)
+        return 0;
+    for (struct text *t = texts; t; t = t->next)
+        if (t->message == message)
+            return t;
+
+    int len = strlen(message);
+    int w = len * FONT_W;
+    struct text *t = malloc(sizeof(*t));
+    unsigned char *alpha = malloc(FONT_H * w * 3 + 1);
+    unsigned char *color = malloc(w * 3 + 1);
+    unsigned char *mask = malloc(FONT_H * w + 1);
+    unsigned char *yuv = malloc(w * 3 + 1);
+    if (!t || !alpha || !color || !mask || !yuv) {
+        fputs("sort: out of memory\n", stderr);
+        exit(1);
+    }
+    for (int y = 0; y < FONT_H; y++) {
+        for (int i = 0; i < len; i++) {
+            int c = (unsigned char)message[i];
+            for (int x = 0; x < FONT_W; x++) {
+                int a = c < 32 || c > 127 ? 0 : glyphs[c - 32][y][x];
+                unsigned char *p = alpha + (y * w + i * FONT_W + x) * 3;
+                p[0] = p[1] = p[2] = a;
+                mask[y * w + i * FONT_W + x] = a;
+            }
+        }
+    }
+    color_row(color, 0xffffffUL, w);
+    yuv_row_generic(color, yuv, yuv + w, yuv + w * 2, w);
+    t->message = message;
+    t->bounds.x0 = PAD;
+    t->bounds.y0 = PAD;
+    t->bounds.x1 = PAD + w;
+    t->bounds.y1 = PAD + FONT_H;
+    t->alpha = alpha;
+    t->color = color;
+    t->mask = mask;
+    t->yuv[0] = yuv;
+    t->yuv[1] = yuv + w;
+    t->yuv[2] = yuv + w * 2;
+    t->next = texts;
+    texts = t;
+    return t;
+}
+
+/* Draw a message overlay, with the buffer laid out as for ppm_dot(). */
+static void
+ppm_text(unsigned char *buf, const struct text *text, struct rect clip)
+{
+    struct rect b = text->bounds;
+    struct rect r = rect_intersect(b, clip);
+    if (rect_empty(r))
+        return;
+
+    int w = b.x1 - b.x0;
+    for (int py = r.y0; py < r.y1; py++) {
+        int ty = py - b.y0;
+        int tx = r.x0 - b.x0;
+        unsigned char *dst = buf + (py - clip.y0) * S * 3 + r.x0 * 3;
+        const unsigned char *a = text->alpha + (ty * w + tx) * 3;
+        blend_row(dst, text->color, a, (r.x1 - r.x0) * 3);
+    }
+}
+
+static unsigned long
+hue(int v)
+{
+    unsigned long h = v / (N / 6);
+    unsigned long f = v % (N / 6);
+    unsigned long t = 0xff * f / (N / 6);
+    unsigned long q = 0xff - t;
+    switch (h) {
+        case 0:
+            return 0xff0000UL | (t << 8);
+        case 1:
+            return (q << 16) | 0x00ff00UL;
+        case 2:
+            return 0x00ff00UL | t;
+        case 3:
+            return (q << 8) | 0x0000ffUL;
+        case 4:
+            return (t << 16) | 0x0000ffUL;
+        case 5:
+            return 0xff0000UL | q;
+    }
+    abort();
+}
+
+/* Dot colors for every array value, computed once at startup. */
+static struct palette {
+    unsigned long rgb;             // packed 24-bit color
+    float r, g, b;                 // channels in [0, 1]
+    unsigned char row[DOT_W * 3];  // 8-bit channels repeated over a dot row
+    unsigned char yuv[3][DOT_W];   // Y, U and V repeated over a dot row
+} palette[N];
+
+static void
+palette_init(void)
+{
+    for (int v = 0; v < N; v++) {
+        unsigned long c = hue(v);
+        palette[v].rgb = c;
+        palette[v].r = (c >> 16) / 255.0f;
+        palette[v].g = ((c >> 8) & 0xff) / 255.0f;
+        palette[v].b = (c & 0xff) / 255.0f;
+        color_row(palette[v].row, c, DOT_W);
+        unsigned char *yuv[3] = {
+            palette[v].yuv[0], palette[v].yuv[1], palette[v].yuv[2]
+        };
+        yuv_row_generic(palette[v].row, yuv[0], yuv[1], yuv[2], DOT_W);
+    }
+}
+
+static int array[N];
+static int swaps[N];
+static int active[N];  // indices with nonzero swaps, in order touched
+static int nactive;
+static const char *message;
+static FILE *wav;
+
+enum format {
+    FORMAT_PPM,
+    FORMAT_Y4M,
+    FORMAT_Y4M444,
+    FORMAT_RGB24,
+    FORMAT_BGRA,
+    FORMAT_NV12,
+    FORMAT_DELTA,
+
+    FORMATS_TOTAL
+};
+
+static const char *const format_names[] = {
+    [FORMAT_PPM] = "ppm",
+    [FORMAT_Y4M] = "y4m",
+    [FORMAT_Y4M444] = "y4m444",
+    [FORMAT_RGB24] = "rgb24",
+    [FORMAT_BGRA] = "bgra",
+    [FORMAT_NV12] = "nv12",
+    [FORMAT_DELTA] = "delta",
+};
+
+static enum format format;
+static int video_started;
+
+/* Shard K of N (-k) renders only the Kth of N equal slices of the
+ * frames. Segments after the first leave out the stream headers so that
+ * the outputs can simply be concatenated.
+ */
+static struct {
+    int k, n;
+} shard;
+
+static int convert;  // render YUV formats in RGB and convert each frame
+
+/* Is the output format YUV rather than RGB? */
+static int
+format_yuv(void)
+{
+    return format == FORMAT_Y4M || format == FORMAT_Y4M444 ||
+           format == FORMAT_NV12;
+}
+
+/* Log2 of the output's chroma subsampling in each direction. */
+static int
+format_shift(void)
+{
+    return format == FORMAT_Y4M || format == FORMAT_NV12;
+}
+
+/* Are frames rendered straight into YUV planes? */
+static int
+yuv_direct(void)
+{
+    return format_yuv() && !convert;
+}
+
+/* Placement of dot i at every possible distance abs(i - array[i]) from
+ * its sorted position. Distances run up to N - 1, where the dot sits on
+ * the far side of the center.
+ */
+static struct place places[N][N];
+
+static void
+layout_init(void)
+{
+    for (int i = 0; i < N; i++) {
+        float x = -sinf(i * 2.0f * PI / N);
+        float y = -cosf(i * 2.0f * PI / N);
+        for (int d = 0; d < N; d++) {
+            float delta = d / (N / 2.0f);
+            float r = S * 15.0f / 32.0f * (1.0f - delta);
+            places[i][d] = dot_place(r * x + S / 2.0f, r * y + S / 2.0f);
+        }
+    }
+}
+
+/* Placement and color of a dot as it appears on screen. */
+struct dot {
+    struct place at;
+    const struct palette *color;
+};
+
+static int
+dot_equal(struct dot a, struct dot b)
+{
+    return a.at.x  == b.at.x  && a.at.y  == b.at.y  &&
+           a.at.sx == b.at.sx && a.at.sy == b.at.sy &&
+           a.at.wx == b.at.wx && a.at.wy == b.at.wy &&
+           a.color == b.color;
+}
+
+/* Place every dot according to the given array. */
+static void
+layout(struct dot *dots, const int *array)
+{
+    for (int i = 0; i < N; i++) {
+        dots[i].at = places[i][abs(i - array[i])];
+        dots[i].color = palette + array[i];
+    }
+}
+
+/* A drawing target: either packed RGB rows, or Y, U and V planes with
+ * chroma subsampled by 1 << shift in each direction. As with ppm_dot(),
+ * each pointer addresses the first row of the region being drawn.
+ */
+struct image {
+    unsigned char *rgb;
+    unsigned char *y, *u, *v;
+    int shift;
+};
+
+/* Chroma plane size for a luma size n. */
+static int
+chroma_size(int n, int shift)
+{
+    return (n + shift) >> shift;
+}
+
+/* Chroma samples covering the luma rectangle r. */
+static struct rect
+chroma_rect(struct rect r, int shift)
+{
+    struct rect c = {
+        r.x0 >> shift, r.y0 >> shift,
+        chroma_size(r.x1, shift), chroma_size(r.y1, shift)
+    };
+    return c;
+}
+
+/* Advance a full-frame image so that it starts at luma row y. */
+static struct image
+image_at(struct image im, int y)
+{
+    if (im.rgb) {
+        im.rgb += y * S * 3;
+    } else {
+        int cw = chroma_size(S, im.shift);
+        im.y += y * S;
+        im.u += (y >> im.shift) * cw;
+        im.v += (y >> im.shift) * cw;
+    }
+    return im;
+}
+
+/* Blend a one-byte-per-pixel alpha mask covering bounds b into the Y, U
+ * and V planes, touching only pixels inside clip. Chroma takes the mean
+ * coverage of each subsampled block. The color is given as rows of
+ * constant Y, U and V at least as wide as the mask.
+ */
+static void
+yuv_mask(struct image im, const unsigned char *mask, struct rect b,
+         const unsigned char *fy, const unsigned char *fu,
+         const unsigned char *fv, struct rect clip)
+{
+    struct rect r = rect_intersect(b, clip);
+    if (rect_empty(r))
+        return;
+
+    int bw = b.x1 - b.x0;
+    for (int py = r.y0; py < r.y1; py++) {
+        unsigned char *dst = im.y + (py - clip.y0) * S + r.x0;
+        const unsigned char *a = mask + (py - b.y0) * bw + r.x0 - b.x0;
+        blend_row(dst, fy, a, r.x1 - r.x0);
+    }
+
+    int sh = im.shift;
+    int cw = chroma_size(S, sh);
+    struct rect cc = chroma_rect(clip, sh);
+    struct rect cr = rect_intersect(chroma_rect(b, sh), cc);
+    for (int cy = cr.y0; cy < cr.y1; cy++) {
+        unsigned char alpha[S];
+        for (int cx = cr.x0; cx < cr.x1; cx++) {
+            int sum = 0, n = 0;
+            for (int py = cy << sh; py < (cy + 1) << sh && py < S; py++) {
+                for (int px = cx << sh; px < (cx + 1) << sh && px < S; px++) {
+                    if (px >= b.x0 && px < b.x1 && py >= b.y0 && py < b.y1)
+                        sum += mask[(py - b.y0) * bw + px - b.x0];
+                    n++;
+                }
+            }
+            alpha[cx - cr.x0] = (sum + n / 2) / n;
+        }
+        int off = (cy - cc.y0) * cw + cr.x0;
+        blend_row(im.u + off, fu, alpha, cr.x1 - cr.x0);
+        blend_row(im.v + off, fv, alpha, cr.x1 - cr.x0);
+    }
+}
+
+static void
+draw_dot(struct image im, const struct dot *d, struct rect clip)
+{
+    if (im.rgb) {
+        ppm_dot(im.rgb, d->at, d->color->row, clip);
+    } else {
+        struct rect b = dot_bounds(d->at);
+        if (rect_empty(rect_intersect(b, clip)))
+            return;
+        unsigned char mask[DOT_W * DOT_W];
+        dot_mask(mask, d->at, 1);
+        const struct palette *c = d->color;
+        yuv_mask(im, mask, b, c->yuv[0], c->yuv[1], c->yuv[2], clip);
+    }
+}
+
+static void
+draw_text(struct image im, const struct text *t, struct rect clip)
+{
+    if (im.rgb)
+        ppm_text(im.rgb, t, clip);
+    else
+        yuv_mask(im, t->mask, t->bounds, t->yuv[0], t->yuv[1], t->yuv[2],
+                 clip);
+}
+
+/* Fill clip with the black background. */
+static void
+clear(struct image im, struct rect clip)
+{
+    int w = clip.x1 - clip.x0;
+    if (im.rgb) {
+        for (int y = clip.y0; y < clip.y1; y++)
+            memset(im.rgb + (y - clip.y0) * S * 3 + clip.x0 * 3, 0, w * 3);
+    } else {
+        for (int y = clip.y0; y < clip.y1; y++)
+            memset(im.y + (y - clip.y0) * S + clip.x0, 16, w);
+        int cw = chroma_size(S, im.shift);
+        struct rect c = chroma_rect(clip, im.shift);
+        for (int y = c.y0; y < c.y1; y++) {
+            memset(im.u + (y - c.y0) * cw + c.x0, 128, c.x1 - c.x0);
+            memset(im.v + (y - c.y0) * cw + c.x0, 128, c.x1 - c.x0);
+        }
+    }
+}
+
+/* Clear clip and draw the listed items into it, in list order. Items
+ * below N are dots and item N is the message overlay.
+ */
+static void
+render_items(struct image im, const struct dot *dots,
+             const struct text *text, const int *items, int nitems,
+             struct rect clip)
+{
+    clear(im, clip);
+    for (int i = 0; i < nitems; i++) {
+        int item = items[i];
+        if (item < N)
+            draw_dot(im, dots + item, clip);
+        else
+            draw_text(im, text, clip);
+    }
+}
+
+/* Clear and redraw everything that falls inside clip. The result inside
+ * clip is identical to a full redraw of the frame, provided that for
+ * subsampled YUV targets clip is aligned to whole chroma blocks.
+ */
+static void
+render(struct image im, const struct dot *dots, const struct text *text,
+       struct rect clip)
+{
+    clear(im, clip);
+    for (int i = 0; i < N; i++)
+        draw_dot(im, dots + i, clip);
+    if (text)
+        draw_text(im, text, clip);
+}
+
+/* Dots and the message sorted into the cells of a grid over the screen.
+ * Within a cell, items stay in drawing order so that cells can be
+ * composited independently with the same result as a serial redraw.
+ */
+struct bins {
+    int w, h;        // cell size in pixels
+    int cols, rows;  // grid size in cells
+    int start[BINS_MAX + 1];
+    int fill[BINS_MAX];
+    int *items;
+    int cap;
+};
+
+static struct bins tiles = {
+    .w = TILE, .h = TILE, .cols = TILES, .rows = TILES
+};
+static struct bins bands = {.w = S, .h = BAND, .cols = 1, .rows = BANDS};
+
+/* Pixel bounds of cell t, clipped to the screen. */
+static struct rect
+bins_cell(const struct bins *b, int t)
+{
+    int x = t % b->cols * b->w;
+    int y = t / b->cols * b->h;
+    struct rect r = {x, y, x + b->w, y + b->h};
+    struct rect screen = {0, 0, S, S};
+    return rect_intersect(r, screen);
+}
+
+static void
+bins_add(struct bins *b, struct rect r, int item, int pass)
+{
+    struct rect screen = {0, 0, S, S};
+    r = rect_intersect(r, screen);
+    if (rect_empty(r))
+        return;
+    for (int cy = r.y0 / b->h; cy <= (r.y1 - 1) / b->h; cy++) {
+        for (int cx = r.x0 / b->w; cx <= (r.x1 - 1) / b->w; cx++) {
+            int t = cy * b->cols + cx;
+            if (pass)
+                b->items[b->fill[t]++] = item;
+            else
+                b->start[t + 1]++;
+        }
+    }
+}
+
+static void
+bins_fill(struct bins *b, const struct dot *dots, const struct text *text)
+{
+    int ncells = b->cols * b->rows;
+    memset(b->start, 0, sizeof(b->start));
+    for (int pass = 0; pass < 2; pass++) {
+        /* First pass counts, second pass scatters (counting sort) */
+        for (int i = 0; i < N; i++)
+            bins_add(b, dot_bounds(dots[i].at), i, pass);
+        if (text)
+            bins_add(b, text->bounds, N, pass);
+        if (pass)
+            break;
+
+        for (int t = 0; t < ncells; t++)
+            b->start[t + 1] += b->start[t];
+        memcpy(b->fill, b->start, sizeof(b->fill));
+        int total = b->start[ncells];
+        if (total > b->cap) {
+            b->cap = total;
+            b->items = realloc(b->items, total * sizeof(*b->items));
+            if (!b->items) {
+                fputs("sort: out of memory\n", stderr);
+                exit(1);
+            }
+        }
+    }
+}
+
+/* Worker pool that composites tiles of a single frame in parallel. */
+static int nthreads = 1;
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation;
+    int nworkers;  // threads started so far, besides the main thread
+    int running;
+    int next;
+    struct image image;
+    const struct dot *dots;
+    const struct text *text;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    0, 0, 0, 0, {0, 0, 0, 0, 0}, 0, 0,
+};
+
+/* Composite tiles until none are left. Called with the lock held. */
+static void
+pool_work(void)
+{
+    while (pool.next < TILES * TILES) {
+        int t = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+        struct rect clip = bins_cell(&tiles, t);
+        int *items = tiles.items + tiles.start[t];
+        int nitems = tiles.start[t + 1] - tiles.start[t];
+        struct image im = image_at(pool.image, clip.y0);
+        render_items(im, pool.dots, pool.text, items, nitems, clip);
+        pthread_mutex_lock(&pool.lock);
+    }
+}
+
+/* Join in from the generation after the one given as arg. */
+static void *
+pool_worker(void *arg)
+{
+    unsigned long seen = (uintptr_t)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        seen = pool.generation;
+        pool_work();
+        if (!--pool.running)
+            pthread_cond_signal(&pool.done);
+    }
+    return 0;
+}
+
+/* Redraw the whole frame one tile at a time across nthreads threads.
+ * Workers are added as -j grows. They are never stopped, so a smaller
+ * -j later on keeps all of them.
+ */
+static void
+render_tiled(struct image im, const struct dot *dots,
+             const struct text *text)
+{
+    for (; pool.nworkers < nthreads - 1; pool.nworkers++) {
+        pthread_t thread;
+        void *seen = (void *)(uintptr_t)pool.generation;
+        if (pthread_create(&thread, 0, pool_worker, seen)) {
+            fputs("sort: could not start render thread\n", stderr);
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+
+    bins_fill(&tiles, dots, text);
+    pthread_mutex_lock(&pool.lock);
+    pool.image = im;
+    pool.dots = dots;
+    pool.text = text;
+    pool.next = 0;
+    pool.running = pool.nworkers + 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pool_work();
+    pool.running--;
+    while (pool.running)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+#define DIRTY_MAX (N / 4)  // moved dots beyond which to redraw everything
+
+/* A framebuffer and a record of what was last drawn into it. The
+ * buffer holds either packed RGB or, back to back, YUV planes.
+ */
+struct canvas {
+    unsigned char buf[S * S * 3];
+    unsigned char *mem;  // frame memory to use instead of buf
+    struct dot drawn[N];
+    const struct text *text;
+    int valid;
+};
+
+static struct image
+canvas_image(struct canvas *cv)
+{
+    struct image im = {0, 0, 0, 0, 0};
+    unsigned char *buf = cv->mem ? cv->mem : cv->buf;
+    if (yuv_direct()) {
+        im.shift = format_shift();
+        int cw = chroma_size(S, im.shift);
+        im.y = buf;
+        im.u = im.y + S * S;
+        im.v = im.u + cw * cw;
+    } else {
+        im.rgb = buf;
+    }
+    return im;
+}
+
+/* Bring a canvas up to date with the given array and message overlay,
+ * redrawing only the regions around dots that moved, unless too much
+ * changed or the message is different. If moved is given, only those n
+ * indices are checked for movement. Tiles are composited on the -j
+ * thread pool when tiled is set.
+ */
+static void
+render_frame(struct canvas *cv, const int *array, const struct text *text,
+             const int *moved, int n, int tiled)
+{
+    struct image im = canvas_image(cv);
+    struct dot dots[N];
+    layout(dots, array);
+
+    int ndirty = 0;
+    struct rect dirty[DIRTY_MAX * 2];
+    int redraw = !cv->valid || text != cv->text;
+    if (!moved)
+        n = N;
+    for (int k = 0; !redraw && k < n; k++) {
+        int i = moved ? moved[k] : k;
+        if (dot_equal(dots[i], cv->drawn[i]))
+            continue;
+        if (ndirty == DIRTY_MAX * 2) {
+            redraw = 1;
+            break;
+        }
+        dirty[ndirty++] = rect_align(dot_bounds(cv->drawn[i].at), im.shift);
+        dirty[ndirty++] = rect_align(dot_bounds(dots[i].at), im.shift);
+    }
+
+    if (redraw && tiled && nthreads > 1) {
+        render_tiled(im, dots, text);
+    } else if (redraw) {
+        struct rect full = {0, 0, S, S};
+        render(im, dots, text, full);
+    } else {
+        for (int i = 0; i < ndirty; i++)
+            render(image_at(im, dirty[i].y0), dots, text, dirty[i]);
+    }
+
+    memcpy(cv->drawn, dots, sizeof(cv->drawn));
+    cv->text = text;
+    cv->valid = 1;
+}
+
+/* YUV output state: the next row of the frame, and chroma planes for
+ * frames converted from RGB or rendered in bands. Chroma can only be
+ * written after the whole luma plane.
+ */
+static struct {
+    int row;
+    unsigned char u[S * S];
+    unsigned char v[S * S];
+} yuv;
+
+static void
+video_check(void)
+{
+    if (ferror(stdout)) {
+        fputs("sort: error writing video frame\n", stderr);
+        exit(1);
+    }
+}
+
+/* AVI output: each video frame is followed by its frame's worth of PCM
+ * audio, interleaved in a single stream. When stdout is seekable the
+ * movie is split into OpenDML RIFF segments of at most AVI_SEG_MAX
+ * bytes, each closed with standard indexes, and the headers are
+ * rewritten at the end with the real lengths and a super index. When
+ * streaming, all sizes are left as zero ("until end of stream").
+ *
+ * Every video and audio chunk has a fixed size, so the layout of the
+ * file follows from the number of frames in each segment alone.
+ */
+#define AVI_SEGS    256            // max RIFF segments, about 256 GB
+#define AVI_SEG_MAX (1L << 30)     // RIFF segment size limit
+#define AVI_PCM     (HZ / FPS * 2) // audio bytes per frame
+#define AVI_INDX    (32 + AVI_SEGS * 16)  // "indx" super index chunk
+#define AVI_HEADER  (12 + 12 + 64 + 12 + 64 + 48 + AVI_INDX + \
+                     12 + 64 + 26 + AVI_INDX + 12 + 256 + 12)
+
+static struct {
+    int enabled;
+    int seekable;
+    int nsegs;
+    int closed;  // every segment has its indexes written
+    unsigned long frames[AVI_SEGS];      // video frames per segment
+    unsigned long long start[AVI_SEGS];  // file offset of each RIFF
+} avi;
+
+/* Bytes in one video frame of the output format, or 0 if the format
+ * has no AVI equivalent.
+ */
+static unsigned long
+avi_frame_size(void)
+{
+    unsigned long cw = (S + 1) / 2;
+    switch (format) {
+        case FORMAT_BGRA:
+            return S * S * 4UL;
+        case FORMAT_Y4M:
+        case FORMAT_NV12:
+            return S * S + cw * cw * 2;
+        case FORMAT_Y4M444:
+            return S * S * 3UL;
+        case FORMAT_PPM:
+        case FORMAT_RGB24:
+        case FORMAT_DELTA:
+            return 0;
+        case FORMATS_TOTAL:
+            abort();
+    }
+    return 0;
+}
+
+/* Bytes per frame in the movie: a video chunk and an audio chunk. */
+static unsigned long
+avi_stride(void)
+{
+    unsigned long size = avi_frame_size();
+    return 8 + size + (size & 1) + 8 + AVI_PCM;
+}
+
+/* Size of a standard index chunk of n entries. */
+static unsigned long
+avi_ix_size(unsigned long n)
+{
+    return 32 + n * 8;
+}
+
+/* File offset of the first chunk in segment s's "movi" list. */
+static unsigned long long
+avi_data(int s)
+{
+    return s ? avi.start[s] + 24 : AVI_HEADER;
+}
+
+/* Size of closed segment s's "movi" list, counted from its fourcc. */
+static unsigned long long
+avi_movi_size(int s)
+{
+    unsigned long n = avi.frames[s];
+    return 4 + n * (unsigned long long)avi_stride() + avi_ix_size(n) * 2;
+}
+
+/* File offset just past the end of closed segment s. */
+static unsigned long long
+avi_end(int s)
+{
+    unsigned long long end = avi_data(s) - 4 + avi_movi_size(s);
+    if (!s)
+        end += 8 + avi.frames[s] * 32;  // "idx1"
+    return end;
+}
+
+static void
+emit_u64le(unsigned long long v, FILE *f)
+{
+    emit_u32le(v & 0xffffffffUL, f);
+    emit_u32le(v >> 32, f);
+}
+
+/* Write the fixed-size file header, through the first "movi" fourcc,
+ * describing the current state of the output.
+ */
+static void
+avi_header(FILE *f)
+{
+    unsigned long size = avi_frame_size();
+    unsigned long total = 0;
+    for (int s = 0; s < avi.nsegs; s++)
+        total += avi.frames[s];
+    int known = avi.closed;
+    unsigned long first = known ? avi.frames[0] : 0;
+    unsigned long fourcc = 0;  // uncompressed RGB
+    int bits = 32;
+    switch (format) {
+        case FORMAT_Y4M:
+            fourcc = 0x49343230UL; // "I420"
+            bits = 12;
+            break;
+        case FORMAT_NV12:
+            fourcc = 0x4e563132UL; // "NV12"
+            bits = 12;
+            break;
+        case FORMAT_Y4M444:
+            fourcc = 0x34343450UL; // "444P"
+            bits = 24;
+            break;
+        case FORMAT_BGRA:
+        case FORMAT_PPM:
+        case FORMAT_RGB24:
+        case FORMAT_DELTA:
+            break;
+        case FORMATS_TOTAL:
+            abort();
+    }
+
+    emit_u32be(0x52494646UL, f); // "RIFF"
+    emit_u32le(known ? avi_end(0) - 8 : 0, f);
+    emit_u32be(0x41564920UL, f); // "AVI "
+    emit_u32be(0x4c495354UL, f); // "LIST"
+    emit_u32le(AVI_HEADER - 32,  f);
+    emit_u32be(0x6864726cUL, f); // "hdrl"
+
+    emit_u32be(0x61766968UL, f); // "avih"
+    emit_u32le(56,               f);
+    emit_u32le(1000000 / FPS,    f); // microseconds per frame
+    emit_u32le(avi_stride() * FPS, f); // max bytes per second
+    emit_u32le(0,                f); // padding granularity
+    emit_u32le(known ? 0x110 : 0x100, f); // (has index,) interleaved
+    emit_u32le(first,            f); // frames in the first RIFF
+    emit_u32le(0,                f); // initial frames
+    emit_u32le(2,                f); // streams
+    emit_u32le(size,             f); // suggested buffer size
+    emit_u32le(S,                f); // width
+    emit_u32le(S,                f); // height
+    for (int i = 0; i < 4; i++)
+        emit_u32le(0, f);
+
+    for (int stream = 0; stream < 2; stream++) {
+        int video = !stream;
+        emit_u32be(0x4c495354UL, f); // "LIST"
+        emit_u32le(video ? 4 + 64 + 48 + AVI_INDX : 4 + 64 + 26 + AVI_INDX,
+                   f);
+        emit_u32be(0x7374726cUL, f); // "strl"
+
+        emit_u32be(0x73747268UL, f); // "strh"
+        emit_u32le(56,               f);
+        emit_u32be(video ? 0x76696473UL : 0x61756473UL, f); // vids/auds
+        emit_u32be(video ? fourcc : 0, f); // handler
+        emit_u32le(0,                f); // flags
+        emit_u16le(0,                f); // priority
+        emit_u16le(0,                f); // language
+        emit_u32le(0,                f); // initial frames
+        emit_u32le(video ? 1 : 2,    f); // scale
+        emit_u32le(video ? FPS : HZ * 2, f); // rate
+        emit_u32le(0,                f); // start
+        emit_u32le(video ? total : total * (HZ / FPS), f); // length
+        emit_u32le(video ? size : AVI_PCM, f); // suggested buffer size
+        emit_u32le(0xffffffffUL,     f); // quality
+        emit_u32le(video ? 0 : 2,    f); // sample size
+        emit_u16le(0,                f); // frame rectangle
+        emit_u16le(0,                f);
+        emit_u16le(video ? S : 0,    f);
+        emit_u16le(video ? S : 0,    f);
+
+        emit_u32be(0x73747266UL, f); // "strf"
+        if (video) {
+            emit_u32le(40,           f); // BITMAPINFOHEADER
+            emit_u32le(40,           f);
+            emit_u32le(S,            f); // width
+            emit_u32le(fourcc ? S : -S, f); // height, RGB top-down
+            emit_u16le(1,            f); // planes
+            emit_u16le(bits,         f); // bits per pixel
+            emit_u32be(fourcc,       f); // compression
+            emit_u32le(size,         f); // image size
+            for (int i = 0; i < 4; i++)
+                emit_u32le(0, f);
+        } else {
+            emit_u32le(18,           f); // WAVEFORMATEX
+            emit_u16le(1,            f); // PCM
+            emit_u16le(1,            f); // mono
+            emit_u32le(HZ,           f); // sample rate
+            emit_u32le(HZ * 2,       f); // byte rate
+            emit_u16le(2,            f); // block size
+            emit_u16le(16,           f); // bits per sample
+            emit_u16le(0,            f); // extra size
+        }
+
+        emit_u32be(0x696e6478UL, f); // "indx"
+        emit_u32le(AVI_INDX - 8,     f);
+        emit_u16le(4,                f); // longs per entry
+        fputc(0, f);                     // sub type
+        fputc(0, f);                     // index of indexes
+        emit_u32le(known ? avi.nsegs : 0, f);
+        emit_u32be(video ? 0x30306463UL : 0x30317762UL, f); // 00dc/01wb
+        for (int i = 0; i < 3; i++)
+            emit_u32le(0, f);
+        for (int s = 0; s < AVI_SEGS; s++) {
+            unsigned long n = s < avi.nsegs ? avi.frames[s] : 0;
+            unsigned long long ix = avi_data(s) + n * avi_stride();
+            ix += video ? 0 : avi_ix_size(n);
+            if (!known || s >= avi.nsegs) {
+                emit_u64le(0, f);
+                emit_u32le(0, f);
+                emit_u32le(0, f);
+            } else {
+                emit_u64le(ix, f);
+                emit_u32le(avi_ix_size(n), f);
+                emit_u32le(video ? n : n * (HZ / FPS), f); // duration
+            }
+        }
+    }
+
+    emit_u32be(0x4c495354UL, f); // "LIST"
+    emit_u32le(4 + 256,          f);
+    emit_u32be(0x6f646d6cUL, f); // "odml"
+    emit_u32be(0x646d6c68UL, f); // "dmlh"
+    emit_u32le(248,              f);
+    emit_u32le(known ? total : 0, f); // total frames
+    for (int i = 0; i < 61; i++)
+        emit_u32le(0, f);
+
+    emit_u32be(0x4c495354UL, f); // "LIST"
+    emit_u32le(known ? avi_movi_size(0) : 0, f);
+    emit_u32be(0x6d6f7669UL, f); // "movi"
+}
+
+/* Most frames that fit in one RIFF segment, with its indexes. */
+static unsigned long
+avi_seg_frames(void)
+{
+    return (AVI_SEG_MAX - AVI_HEADER - 64) / (avi_stride() + 48);
+}
+
+/* Write the standard indexes closing the last segment's "movi" list,
+ * plus the legacy "idx1" index after the first segment.
+ */
+static void
+avi_index(void)
+{
+    int s = avi.nsegs - 1;
+    unsigned long n = avi.frames[s];
+    unsigned long size = avi_frame_size();
+    unsigned long stride = avi_stride();
+    unsigned long audio = stride - 8 - AVI_PCM;  // audio chunk in a frame
+    for (int stream = 0; stream < 2; stream++) {
+        int video = !stream;
+        emit_u32be(video ? 0x69783030UL : 0x69783031UL, stdout); // ix00/01
+        emit_u32le(avi_ix_size(n) - 8, stdout);
+        emit_u16le(2, stdout);  // longs per entry
+        fputc(0, stdout);       // sub type
+        fputc(1, stdout);       // index of chunks
+        emit_u32le(n, stdout);
+        emit_u32be(video ? 0x30306463UL : 0x30317762UL, stdout);
+        emit_u64le(avi_data(s), stdout);
+        emit_u32le(0, stdout);
+        for (unsigned long i = 0; i < n; i++) {
+            emit_u32le(i * stride + (video ? 0 : audio) + 8, stdout);
+            emit_u32le(video ? size : AVI_PCM, stdout);
+        }
+    }
+    if (!s) {
+        emit_u32be(0x69647831UL, stdout); // "idx1"
+        emit_u32le(n * 32, stdout);
+        for (unsigned long i = 0; i < n; i++) {
+            emit_u32be(0x30306463UL, stdout); // "00dc"
+            emit_u32le(0x10, stdout);         // key frame
+            emit_u32le(4 + i * stride, stdout);
+            emit_u32le(size, stdout);
+            emit_u32be(0x30317762UL, stdout); // "01wb"
+            emit_u32le(0x10, stdout);
+            emit_u32le(4 + i * stride + audio, stdout);
+            emit_u32le(AVI_PCM, stdout);
+        }
+    }
+    video_check();
+}
+
+/* Open a video chunk, writing the header or starting a new segment
+ * first as needed.
+ */
+static void
+avi_begin(void)
+{
+    unsigned long size = avi_frame_size();
+    if (!avi.nsegs) {
+        if (!size) {
+            fputs("sort: AVI needs -f bgra, nv12, y4m or y4m444\n", stderr);
+            exit(1);
+        }
+        avi.seekable = ftello(stdout) == 0;
+        avi.nsegs = 1;
+        avi_header(stdout);
+        assert(!avi.seekable || ftello(stdout) == AVI_HEADER);
+    } else if (avi.seekable && avi.frames[avi.nsegs - 1] == avi_seg_frames()) {
+        if (avi.nsegs == AVI_SEGS) {
+            fputs("sort: AVI output too large\n", stderr);
+            exit(1);
+        }
+        avi_index();
+        avi.start[avi.nsegs] = avi_end(avi.nsegs - 1);
+        avi.nsegs++;
+        emit_u32be(0x52494646UL, stdout); // "RIFF"
+        emit_u32le(0, stdout);            // patched by avi_finish()
+        emit_u32be(0x41564958UL, stdout); // "AVIX"
+        emit_u32be(0x4c495354UL, stdout); // "LIST"
+        emit_u32le(0, stdout);
+        emit_u32be(0x6d6f7669UL, stdout); // "movi"
+    }
+    avi.frames[avi.nsegs - 1]++;
+    emit_u32be(0x30306463UL, stdout); // "00dc"
+    emit_u32le(size, stdout);
+}
+
+/* Close the video chunk and follow it with the frame's audio. */
+static void
+avi_audio(const unsigned char *pcm)
+{
+    if (!avi.enabled)
+        return;
+    emit_u32be(0x30317762UL, stdout); // "01wb"
+    emit_u32le(AVI_PCM, stdout);
+    fwrite(pcm, AVI_PCM, 1, stdout);
+    video_check();
+}
+
+static void
+avi_seek(unsigned long long offset)
+{
+    if (fseeko(stdout, offset, SEEK_SET)) {
+        fputs("sort: error seeking in video output\n", stderr);
+        exit(1);
+    }
+}
+
+/* Index the last segment and rewrite the headers with final sizes. */
+static void
+avi_finish(void)
+{
+    if (!avi.nsegs)
+        return;
+    if (avi.seekable) {
+        avi_index();
+        avi.closed = 1;
+        avi_seek(0);
+        avi_header(stdout);
+        for (int s = 1; s < avi.nsegs; s++) {
+            avi_seek(avi.start[s] + 4);
+            emit_u32le(avi_end(s) - avi.start[s] - 8, stdout);
+            avi_seek(avi.start[s] + 16);
+            emit_u32le(avi_movi_size(s), stdout);
+        }
+        avi_seek(avi_end(avi.nsegs - 1));
+    }
+    if (fflush(stdout)) {
+        fputs("sort: error writing video frame\n", stderr);
+        exit(1);
+    }
+}
+
+/* Delta stream format: a 16-byte header ("SRTD", then width, height and
+ * frame rate as 32-bit little endian), followed by frames coded against
+ * the previous frame, which starts out black. Each frame is a sequence
+ * of runs that together cover every pixel in raster order. A run starts
+ * with a LEB128 varint holding length << 2 | op:
+ *
+ *   0  SKIP     pixels are unchanged from the previous frame
+ *   1  ZERO     pixels are black
+ *   2  LITERAL  followed by length packed RGB pixels
+ *
+ * Frames are mostly black and differ by a handful of dots, so a typical
+ * frame codes to a few kilobytes.
+ */
+enum delta_op {DELTA_SKIP, DELTA_ZERO, DELTA_LITERAL};
+
+static struct {
+    int row;
+    unsigned char prev[S * S * 3];
+    unsigned char out[S * S * 3 + 16];
+} delta;
+
+static void
+delta_header(FILE *f)
+{
+    emit_u32be(0x53525444UL, f); // "SRTD"
+    emit_u32le(S, f);
+    emit_u32le(S, f);
+    emit_u32le(FPS, f);
+}
+
+static unsigned char *
+delta_run(unsigned char *p, enum delta_op op, unsigned long n)
+{
+    unsigned long v = n << 2 | op;
+    for (; v > 0x7f; v >>= 7)
+        *p++ = (v & 0x7f) | 0x80;
+    *p++ = v;
+    return p;
+}
+
+/* Length of the common prefix of a and b, up to n bytes. */
+static size_t
+delta_same(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t x[2], y[2];
+        memcpy(x, a + i, 16);
+        memcpy(y, b + i, 16);
+        if ((x[0] ^ y[0]) | (x[1] ^ y[1]))
+            break;
+    }
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/* Length of the run of zero bytes at a, up to n bytes. */
+static size_t
+delta_zero(const unsigned char *a, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t x[2];
+        memcpy(x, a + i, 16);
+        if (x[0] | x[1])
+            break;
+    }
+    while (i < n && !a[i])
+        i++;
+    return i;
+}
+
+/* Code the next n rows of the frame against the previous frame, and
+ * make them the new previous rows.
+ */
+static void
+delta_rows(const unsigned char *rows, int n)
+{
+    unsigned char *prev = delta.prev + delta.row * S * 3;
+    unsigned char *p = delta.out;
+    size_t len = (size_t)n * S;
+    size_t i = 0;
+    while (i < len) {
+        const unsigned char *c = rows + i * 3;
+        size_t run = delta_same(c, prev + i * 3, (len - i) * 3) / 3;
+        if (run) {
+            p = delta_run(p, DELTA_SKIP, run);
+        } else if (!(run = delta_zero(c, (len - i) * 3) / 3)) {
+            /* Literal pixels, until one is unchanged or black */
+            run = 1;
+            while (i + run < len &&
+                   memcmp(c + run * 3, prev + (i + run) * 3, 3) &&
+                   (c[run * 3] | c[run * 3 + 1] | c[run * 3 + 2]))
+                run++;
+            p = delta_run(p, DELTA_LITERAL, run);
+            memcpy(p, c, run * 3);
+            memcpy(prev + i * 3, c, run * 3);
+            p += run * 3;
+        } else {
+            p = delta_run(p, DELTA_ZERO, run);
+            memset(prev + i * 3, 0, run * 3);
+        }
+        i += run;
+    }
+    fwrite(delta.out, p - delta.out, 1, stdout);
+    delta.row += n;
+}
+
+static void
+video_begin(void)
+{
+    char head[64];
+    if (avi.enabled) {
+        avi_begin();
+    } else {
+        switch (format) {
+            case FORMAT_PPM:
+                fwrite(head, ppm_header(head), 1, stdout);
+                break;
+            case FORMAT_Y4M:
+            case FORMAT_Y4M444:
+                if (!video_started && shard.k < 2) {
+                    const char *c = format == FORMAT_Y4M ? "420jpeg" : "444";
+                    fwrite(head, y4m_header(head, c), 1, stdout);
+                }
+                fputs("FRAME\n", stdout);
+                break;
+            case FORMAT_RGB24:
+            case FORMAT_BGRA:
+            case FORMAT_NV12:
+                break;  // headerless
+            case FORMAT_DELTA:
+                if (!video_started)
+                    delta_header(stdout);
+                break;
+            case FORMATS_TOTAL:
+                abort();
+        }
+    }
+    video_started = 1;
+    yuv.row = 0;
+    delta.row = 0;
+}
+
+/* Write out the next n full-width rows of the current video frame. RGB
+ * rows are converted as needed, and for 4:2:0 output n must be even
+ * except at the bottom of the frame. For YUV images only luma is
+ * written, as chroma was drawn straight into the planes video_end()
+ * will be given.
+ */
+static void
+video_rows(struct image im, int n)
+{
+    unsigned char y[2][S], u[2][S], v[2][S];
+    const unsigned char *rows = im.rgb;
+    int cw = (S + 1) / 2;
+    if (!rows) {
+        fwrite(im.y, S, n, stdout);
+        video_check();
+        return;
+    }
+    switch (format) {
+        case FORMAT_PPM:
+        case FORMAT_RGB24:
+            fwrite(rows, S * 3, n, stdout);
+            break;
+        case FORMAT_BGRA:
+            for (int i = 0; i < n; i += 16) {
+                /* Convert in batches so writes bypass stdio's buffer */
+                static unsigned char bgra[16][S * 4];
+                int m = n - i < 16 ? n - i : 16;
+                for (int k = 0; k < m; k++)
+                    bgra_row(rows + (i + k) * S * 3, bgra[k], S);
+                fwrite(bgra, S * 4, m, stdout);
+            }
+            break;
+        case FORMAT_DELTA:
+            delta_rows(rows, n);
+            break;
+        case FORMAT_Y4M:
+        case FORMAT_NV12:
+            for (int i = 0; i < n; i += 2) {
+                int pair = i + 1 < n;
+                for (int k = 0; k <= pair; k++)
+                    yuv_row(rows + (i + k) * S * 3, y[k], u[k], v[k], S);
+                fwrite(y, S, 1 + pair, stdout);
+                int c = yuv.row / 2 * cw;
+                half_row(u[0], u[pair], yuv.u + c, S);
+                half_row(v[0], v[pair], yuv.v + c, S);
+                yuv.row += 2;
+            }
+            break;
+        case FORMAT_Y4M444:
+            for (int i = 0; i < n; i++) {
+                unsigned char *pu = yuv.u + yuv.row * S;
+                unsigned char *pv = yuv.v + yuv.row * S;
+                yuv_row(rows + i * S * 3, y[0], pu, pv, S);
+                fwrite(y[0], S, 1, stdout);
+                yuv.row++;
+            }
+            break;
+        case FORMATS_TOTAL:
+            abort();
+    }
+    video_check();
+}
+
+/* Finish the frame, writing out the given chroma planes if needed. */
+static void
+video_end(const unsigned char *u, const unsigned char *v)
+{
+    int cw = (S + 1) / 2;
+    switch (format) {
+        case FORMAT_PPM:
+        case FORMAT_RGB24:
+        case FORMAT_BGRA:
+        case FORMAT_DELTA:
+            break;
+        case FORMAT_Y4M:
+            fwrite(u, cw, cw, stdout);
+            fwrite(v, cw, cw, stdout);
+            break;
+        case FORMAT_NV12:
+            for (int y = 0; y < cw; y++) {
+                unsigned char uv[S + 1];
+                for (int x = 0; x < cw; x++) {
+                    uv[x * 2 + 0] = u[y * cw + x];
+                    uv[x * 2 + 1] = v[y * cw + x];
+                }
+                fwrite(uv, cw, 2, stdout);
+            }
+            break;
+        case FORMAT_Y4M444:
+            fwrite(u, S, S, stdout);
+            fwrite(v, S, S, stdout);
+            break;
+        case FORMATS_TOTAL:
+            abort();
+    }
+    if (avi.enabled && avi_frame_size() & 1)
+        fputc(0, stdout);  // chunk padding
+    video_check();
+}
+
+static void
+video_write(struct image im)
+{
+    video_begin();
+    video_rows(im, S);
+    if (im.rgb)
+        video_end(yuv.u, yuv.v);
+    else
+        video_end(im.u, im.v);
+}
+
+static unsigned long
+delta_read_u32le(FILE *in)
+{
+    unsigned long v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = getc(in);
+        v |= (unsigned long)(c == EOF ? 0 : c) << (i * 8);
+    }
+    return v;
+}
+
+static void
+delta_truncated(void)
+{
+    fputs("sort: invalid or truncated delta stream\n", stderr);
+    exit(1);
+}
+
+/* Decode a delta stream from in, writing each frame in the current
+ * video format.
+ */
+static void
+delta_decode(FILE *in)
+{
+    if (format == FORMAT_DELTA || avi.enabled) {
+        fputs("sort: -d needs a video format other than delta\n", stderr);
+        exit(1);
+    }
+    if (delta_read_u32le(in) != 0x44545253UL) // "SRTD"
+        delta_truncated();
+    if (delta_read_u32le(in) != S || delta_read_u32le(in) != S) {
+        fprintf(stderr, "sort: delta stream is not %dx%d\n", S, S);
+        exit(1);
+    }
+    delta_read_u32le(in);  // frame rate
+
+    unsigned char *frame = delta.prev;
+    for (;;) {
+        size_t len = (size_t)S * S;
+        size_t i = 0;
+        while (i < len) {
+            unsigned long v = 0;
+            int shift = 0;
+            int c;
+            do {
+                c = getc(in);
+                if (c == EOF) {
+                    if (!i && !shift && !ferror(in))
+                        return;  // end of stream
+                    delta_truncated();
+                }
+                v |= (unsigned long)(c & 0x7f) << shift;
+                shift += 7;
+            } while (c & 0x80 && shift < 35);
+            size_t run = v >> 2;
+            if (!run || run > len - i)
+                delta_truncated();
+            switch (v & 3) {
+                case DELTA_SKIP:
+                    break;
+                case DELTA_ZERO:
+                    memset(frame + i * 3, 0, run * 3);
+                    break;
+                case DELTA_LITERAL:
+                    if (!fread(frame + i * 3, run * 3, 1, in))
+                        delta_truncated();
+                    break;
+                default:
+                    delta_truncated();
+            }
+            i += run;
+        }
+        struct image im = {frame, 0, 0, 0, 0};
+        video_write(im);
+    }
+}
+
+/* Render and write a frame one horizontal band at a time, so that only
+ * a cache-sized slice of the frame ever exists in memory.
+ */
+static int banded;
+
+static void
+render_banded(const int *array, const struct text *text)
+{
+    static unsigned char band[BAND * S * 3];
+    struct dot dots[N];
+    layout(dots, array);
+    bins_fill(&bands, dots, text);
+    video_begin();
+    for (int t = 0; t < BANDS; t++) {
+        struct rect clip = bins_cell(&bands, t);
+        int *items = bands.items + bands.start[t];
+        int nitems = bands.start[t + 1] - bands.start[t];
+        struct image im = {band, 0, 0, 0, 0};
+        if (yuv_direct()) {
+            /* Luma goes through the band, chroma into whole planes */
+            im.rgb = 0;
+            im.shift = format_shift();
+            int c = (clip.y0 >> im.shift) * chroma_size(S, im.shift);
+            im.y = band;
+            im.u = yuv.u + c;
+            im.v = yuv.v + c;
+        }
+        render_items(im, dots, text, items, nitems, clip);
+        video_rows(im, clip.y1 - clip.y0);
+    }
+    video_end(yuv.u, yuv.v);
+}
+
+/* Frame-parallel rendering: the sort thread queues snapshots of array[]
+ * and message into a ring, a pool of workers renders them into the
+ * ring's canvases, and a writer thread outputs them in order. Each slot
+ * keeps its canvas, so workers still redraw incrementally against the
+ * frame that last occupied the slot.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;    // a snapshot is ready to render
+    pthread_cond_t rendered;  // a frame finished rendering
+    pthread_cond_t written;   // a slot was freed by the writer
+    int nworkers;
+    int nslots;
+    struct frame_slot {
+        int array[N];
+        const struct text *text;
+        unsigned char pcm[AVI_PCM];
+        int ready;
+        struct canvas *canvas;
+    } *slots;
+    unsigned long head;   // next snapshot to queue
+    unsigned long claim;  // next snapshot to render
+    unsigned long tail;   // next frame to write
+    int finished;
+    pthread_t writer;
+} frames = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static void *
+frames_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&frames.lock);
+    for (;;) {
+        while (frames.claim == frames.head && !frames.finished)
+            pthread_cond_wait(&frames.queued, &frames.lock);
+        if (frames.claim == frames.head)
+            break;
+        unsigned long seq = frames.claim++;
+        struct frame_slot *slot = frames.slots + seq % frames.nslots;
+        pthread_mutex_unlock(&frames.lock);
+        render_frame(slot->canvas, slot->array, slot->text, 0, 0, 0);
+        pthread_mutex_lock(&frames.lock);
+        slot->ready = 1;
+        pthread_cond_signal(&frames.rendered);
+    }
+    pthread_mutex_unlock(&frames.lock);
+    return 0;
+}
+
+static void *
+frames_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&frames.lock);
+    for (;;) {
+        struct frame_slot *slot = frames.slots + frames.tail % frames.nslots;
+        while (frames.tail < frames.head && !slot->ready)
+            pthread_cond_wait(&frames.rendered, &frames.lock);
+        if (frames.tail == frames.head) {
+            if (frames.finished)
+                break;
+            pthread_cond_wait(&frames.queued, &frames.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&frames.lock);
+        video_write(canvas_image(slot->canvas));
+        avi_audio(slot->pcm);
+        pthread_mutex_lock(&frames.lock);
+        slot->ready = 0;
+        frames.tail++;
+        pthread_cond_signal(&frames.written);
+    }
+    pthread_mutex_unlock(&frames.lock);
+    return 0;
+}
+
+static void
+frames_start(int nworkers)
+{
+    frames.nworkers = nworkers;
+    frames.nslots = nworkers * 2 + 1;
+    frames.slots = calloc(frames.nslots, sizeof(*frames.slots));
+    if (!frames.slots) {
+        fputs("sort: out of memory\n", stderr);
+        exit(1);
+    }
+    for (int i = 0; i < frames.nslots; i++) {
+        frames.slots[i].canvas = calloc(1, sizeof(struct canvas));
+        if (!frames.slots[i].canvas) {
+            fputs("sort: out of memory\n", stderr);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, frames_worker, 0)) {
+            fputs("sort: could not start render thread\n", stderr);
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    if (pthread_create(&frames.writer, 0, frames_writer, 0)) {
+        fputs("sort: could not start writer thread\n", stderr);
+        exit(1);
+    }
+}
+
+/* Queue a snapshot of the current frame and its audio, waiting for a
+ * free slot.
+ */
+static void
+frames_push(const unsigned char *pcm)
+{
+    pthread_mutex_lock(&frames.lock);
+    while (frames.head - frames.tail == (unsigned long)frames.nslots)
+        pthread_cond_wait(&frames.written, &frames.lock);
+    struct frame_slot *slot = frames.slots + frames.head % frames.nslots;
+    pthread_mutex_unlock(&frames.lock);
+
+    memcpy(slot->array, array, sizeof(slot->array));
+    slot->text = text_get(message);
+    if (avi.enabled)
+        memcpy(slot->pcm, pcm, sizeof(slot->pcm));
+
+    pthread_mutex_lock(&frames.lock);
+    frames.head++;
+    pthread_cond_broadcast(&frames.queued);
+    pthread_mutex_unlock(&frames.lock);
+}
+
+/* Wait for every queued frame to be written out. */
+static void
+frames_finish(void)
+{
+    if (!frames.nworkers)
+        return;
+    pthread_mutex_lock(&frames.lock);
+    frames.finished = 1;
+    pthread_cond_broadcast(&frames.queued);
+    pthread_mutex_unlock(&frames.lock);
+    pthread_join(frames.writer, 0);
+    if (fflush(stdout)) {
+        fputs("sort: error writing video frame\n", stderr);
+        exit(1);
+    }
+}
+
+/* A counting semaphore. POSIX unnamed semaphores are not available
+ * everywhere (macOS lacks them), so it's built like the -p ring's
+ * handoff from a mutex and a condition variable.
+ */
+struct sema {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+};
+
+static int
+sema_init(struct sema *s, int count)
+{
+    s->count = count;
+    if (pthread_mutex_init(&s->lock, 0))
+        return -1;
+    return pthread_cond_init(&s->cond, 0) ? -1 : 0;
+}
+
+static void
+sema_destroy(struct sema *s)
+{
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+}
+
+static void
+sema_wait(struct sema *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (!s->count)
+        pthread_cond_wait(&s->cond, &s->lock);
+    s->count--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void
+sema_post(struct sema *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->count++;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Write-behind output: the sort thread renders each frame into the next
+ * slot of a single-producer, single-consumer ring and carries on, while
+ * a writer thread writes out slots in order, video and audio together.
+ * Each side owns its own index into the ring. Two counting semaphores
+ * hand slots back and forth, one short lock each way unless a side has
+ * to sleep on a full or empty ring.
+ */
+static struct {
+    int depth;
+    unsigned long head;     // next slot to fill, sort thread only
+    unsigned long tail;     // next slot to write, writer thread only
+    unsigned long drained;  // head as of the last behind_drain()
+    struct sema filled;
+    struct sema empty;
+    struct behind_slot {
+        struct canvas *canvas;
+        unsigned char pcm[AVI_PCM];
+        FILE *wav;  // where pcm goes, as of when the frame was queued
+        int last;   // no more frames follow
+    } *slots;
+    pthread_t writer;
+} behind;
+
+
+static void
+wav_write(FILE *wav, const unsigned char *pcm)
+{
+    if (wav) {
+        fwrite(pcm, AVI_PCM, 1, wav);
+        if (ferror(wav)) {
+            fputs("sort: error writing audio frame\n", stderr);
+            exit(1);
+        }
+    }
+}
+
+static void *
+behind_writer(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        sema_wait(&behind.filled);
+        struct behind_slot *slot = behind.slots + behind.tail++ % behind.depth;
+        if (slot->last)
+            break;
+        video_write(canvas_image(slot->canvas));
+        avi_audio(slot->pcm);
+        wav_write(slot->wav, slot->pcm);
+        sema_post(&behind.empty);
+    }
+    return 0;
+}
+
+static void
+behind_start(int depth)
+{
+    behind.depth = depth;
+    behind.slots = calloc(depth, sizeof(*behind.slots));
+    if (!behind.slots) {
+        fputs("sort: out of memory\n", stderr);
+        exit(1);
+    }
+    for (int i = 0; i < depth; i++) {
+        behind.slots[i].canvas = calloc(1, sizeof(struct canvas));
+        if (!behind.slots[i].canvas) {
+            fputs("sort: out of memory\n", stderr);
+            exit(1);
+        }
+    }
+    if (sema_init(&behind.filled, 0) ||
+        sema_init(&behind.empty, depth) ||
+        pthread_create(&behind.writer, 0, behind_writer, 0)) {
+        fputs("sort: could not start writer thread\n", stderr);
+        exit(1);
+    }
+}
+
+/* Render the current frame into the next free slot and queue it. */
+static void
+behind_push(const unsigned char *pcm)
 {
-    fputc((v >>  0) & 0xff, f);
-    fputc((v >>  8) & 0xff, f);
-    fputc((v >> 16) & 0xff, f);
-    fputc((v >> 24) & 0xff, f);
+    sema_wait(&behind.empty);
+    struct behind_slot *slot = behind.slots + behind.head++ % behind.depth;
+    render_frame(slot->canvas, array, text_get(message), 0, 0, 1);
+    if (wav || avi.enabled)
+        memcpy(slot->pcm, pcm, sizeof(slot->pcm));
+    slot->wav = wav;
+    sema_post(&behind.filled);
 }
 
+/* Wait for every queued frame to be written out, leaving the writer
+ * running, before frames are written some other way.
+ */
 static void
-emit_u32be(unsigned long v, FILE *f)
+behind_drain(void)
 {
-    fputc((v >> 24) & 0xff, f);
-    fputc((v >> 16) & 0xff, f);
-    fputc((v >>  8) & 0xff, f);
-    fputc((v >>  0) & 0xff, f);
+    if (behind.drained == behind.head)
+        return;
+    for (int i = 0; i < behind.depth; i++)
+        sema_wait(&behind.empty);
+    for (int i = 0; i < behind.depth; i++)
+        sema_post(&behind.empty);
+    behind.drained = behind.head;
 }
 
+/* Wait for every queued frame to be written out. */
 static void
-emit_u16le(unsigned v, FILE *f)
+behind_finish(void)
 {
-    fputc((v >> 0) & 0xff, f);
-    fputc((v >> 8) & 0xff, f);
+    if (!behind.depth)
+        return;
+    sema_wait(&behind.empty);
+    behind.slots[behind.head++ % behind.depth].last = 1;
+    sema_post(&behind.filled);
+    pthread_join(behind.writer, 0);
+    if (fflush(stdout)) {
+        fputs("sort: error writing video frame\n", stderr);
+        exit(1);
+    }
 }
 
-static float
-clamp(float x, float lower, float upper)
+/* Zero-copy pipe output (Linux). When standard output is a pipe, frames
+ * are rendered into a ring of page-aligned canvases whose pages are
+ * handed to the pipe with vmsplice() rather than copied. A canvas is
+ * only drawn on again after enough later frames have been queued to
+ * push its pages out of the pipe, plus some slack for readers that
+ * splice them onward into pipes of their own. Files and terminals keep
+ * using stdio.
+ */
+#define ZEROCOPY_PIPE  (1L << 20)  // requested pipe size
+#define ZEROCOPY_SLACK (1L << 20)  // data buffered past our pipe
+#define ZEROCOPY_MAX   64          // max canvases in the ring
+
+static struct {
+    int checked;
+    int n;  // canvases in the ring, 0 when disabled
+    unsigned long next;
+    struct canvas *ring[ZEROCOPY_MAX];
+} zerocopy;
+
+/* Bytes in a frame that can be written straight out of a canvas, or 0
+ * when the output format needs conversion.
+ */
+static size_t
+zerocopy_size(void)
 {
-    if (x < lower)
-        return lower;
-    if (x > upper)
-        return upper;
-    return x;
+    size_t cw = chroma_size(S, format_shift());
+    switch (format) {
+        case FORMAT_PPM:
+        case FORMAT_RGB24:
+            return S * S * 3;
+        case FORMAT_Y4M:
+        case FORMAT_Y4M444:
+            return yuv_direct() ? S * S + cw * cw * 2 : 0;
+        case FORMAT_BGRA:
+        case FORMAT_NV12:
+        case FORMAT_DELTA:
+            return 0;
+        case FORMATS_TOTAL:
+            abort();
+    }
+    return 0;
 }
 
-static float
-smoothstep(float lower, float upper, float x)
+/* Set up the canvas ring on first use. Returns non-zero if frames
+ * should go through zerocopy_write().
+ */
+static int
+zerocopy_init(void)
 {
-    x = clamp((x - lower) / (upper - lower), 0.0f, 1.0f);
-    return x * x * (3.0f - 2.0f * x);
+    #ifdef __linux__
+    if (zerocopy.checked)
+        return zerocopy.n;
+    zerocopy.checked = 1;
+
+    struct stat st;
+    size_t size = zerocopy_size();
+    if (!size || fstat(1, &st) || !S_ISFIFO(st.st_mode))
+        return 0;
+
+    /* Grow the pipe as far as we're allowed */
+    long cap = -1;
+    for (long n = ZEROCOPY_PIPE; cap < 0 && n >= 4096; n /= 2)
+        cap = fcntl(1, F_SETPIPE_SZ, n);
+    if (cap < 0)
+        cap = fcntl(1, F_GETPIPE_SZ);
+    if (cap < 0)
+        return 0;
+
+    int n = (cap + ZEROCOPY_SLACK) / size + 2;
+    if (n > ZEROCOPY_MAX)
+        n = ZEROCOPY_MAX;
+    long page = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < n; i++) {
+        void *p;
+        if (page < 0)
+            page = 4096;
+        if (posix_memalign(&p, page, sizeof(struct canvas))) {
+            fputs("sort: out of memory\n", stderr);
+            exit(1);
+        }
+        zerocopy.ring[i] = memset(p, 0, sizeof(struct canvas));
+    }
+    zerocopy.n = n;
+    return n;
+    #else
+    return 0;
+    #endif
 }
 
-/* Convert 24-bit color to RGB. */
+/* Render the current frame into the next canvas of the ring and splice
+ * it into the pipe.
+ */
 static void
-rgb_split(unsigned long c, float *r, float *g, float *b)
+zerocopy_write(const int *array, const struct text *text)
 {
-    *r = ((c >> 16) / 255.0f);
-    *g = (((c >> 8) & 0xff) / 255.0f);
-    *b = ((c & 0xff) / 255.0f);
+    #ifdef __linux__
+    struct canvas *cv = zerocopy.ring[zerocopy.next++ % zerocopy.n];
+    render_frame(cv, array, text, 0, 0, 1);
+
+    /* Headers go through stdio and must precede the pixels */
+    video_begin();
+    if (fflush(stdout)) {
+        fputs("sort: error writing video frame\n", stderr);
+        exit(1);
+    }
+
+    size_t len = zerocopy_size();
+    struct iovec v = {cv->buf, len};
+    while (v.iov_len) {
+        ssize_t r = vmsplice(1, &v, 1, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            fputs("sort: error writing video frame\n", stderr);
+            exit(1);
+        }
+        v.iov_base = (char *)v.iov_base + r;
+        v.iov_len -= r;
+    }
+    if (avi.enabled && len & 1)
+        fputc(0, stdout);  // chunk padding
+    #else
+    (void)array;
+    (void)text;
+    #endif
 }
 
-/* Convert RGB to 24-bit color. */
-static unsigned long
-rgb_join(float r, float g, float b)
+/* Memory-mapped output (-o). The whole file is sized up front from a
+ * dry run of the sorts that only counts frames, preallocated, and
+ * mapped. Each frame is then composited straight into its place in the
+ * file, starting from a copy of the previous frame so that only what
+ * changed is redrawn, and write-back is left to the kernel. Formats that
+ * need converting, and the -b, -p, -l, -m and -d modes, write to the file
+ * through stdio instead.
+ */
+static int dry_run;  // only count frames
+
+static struct {
+    const char *path;
+    int opened;
+    unsigned long total;  // frames counted by the dry run
+    unsigned long frames;
+    unsigned char *map;
+    size_t size;
+    size_t pos;
+    char head[64];  // per-frame header
+    int headlen;
+} out;
+
+static void
+output_open(int decode)
+{
+    out.opened = 1;
+    size_t frame = zerocopy_size();
+    int mappable = frame && !decode && !avi.enabled && !banded &&
+                   !frames.nworkers && !behind.depth;
+    #ifndef __linux__
+    mappable = 0;
+    #endif
+    if (!mappable) {
+        if (!freopen(out.path, "wb", stdout)) {
+            fprintf(stderr, "sort: %s: %s\n", strerror(errno), out.path);
+            exit(1);
+        }
+        return;
+    }
+
+    #ifdef __linux__
+    char stream[64];
+    int streamlen = 0;
+    switch (format) {
+        case FORMAT_PPM:
+            out.headlen = ppm_header(out.head);
+            break;
+        case FORMAT_Y4M:
+        case FORMAT_Y4M444:
+            if (shard.k < 2)
+                streamlen = y4m_header(stream, format == FORMAT_Y4M ?
+                                       "420jpeg" : "444");
+            out.headlen = sprintf(out.head, "FRAME\n");
+            break;
+        case FORMAT_RGB24:
+        case FORMAT_BGRA:
+        case FORMAT_NV12:
+        case FORMAT_DELTA:
+            break;
+        case FORMATS_TOTAL:
+            abort();
+    }
+    out.size = streamlen + (out.headlen + frame) * out.total;
+
+    int fd = open(out.path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "sort: %s: %s\n", strerror(errno), out.path);
+        exit(1);
+    }
+    int err = out.size ? posix_fallocate(fd, 0, out.size) : 0;
+    if (err == EINVAL || err == EOPNOTSUPP)
+        err = ftruncate(fd, out.size) ? errno : 0;
+    if (err) {
+        fprintf(stderr, "sort: %s: %s\n", strerror(err), out.path);
+        exit(1);
+    }
+    if (out.size) {
+        out.map = mmap(0, out.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+        if (out.map == MAP_FAILED) {
+            fprintf(stderr, "sort: %s: %s\n", strerror(errno), out.path);
+            exit(1);
+        }
+        memcpy(out.map, stream, streamlen);
+        out.pos = streamlen;
+    }
+    close(fd);
+    #endif
+}
+
+/* Render the current frame into its place in the mapped file. */
+static void
+output_frame(void)
 {
-    unsigned long ir = roundf(r * 255.0f);
-    unsigned long ig = roundf(g * 255.0f);
-    unsigned long ib = roundf(b * 255.0f);
-    return (ir << 16) | (ig << 8) | ib;
+    static struct canvas canvas;
+    size_t size = zerocopy_size();
+    if (out.frames++ == out.total) {
+        fputs("sort: more frames than counted\n", stderr);
+        exit(1);
+    }
+    unsigned char *p = out.map + out.pos;
+    #if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+    /* Fault in the whole slot at once rather than a page at a time */
+    uintptr_t lo = (uintptr_t)p & -(uintptr_t)4096;
+    uintptr_t hi = (uintptr_t)p + out.headlen + size;
+    madvise((void *)lo, hi - lo, MADV_POPULATE_WRITE);
+    #endif
+    memcpy(p, out.head, out.headlen);
+    p += out.headlen;
+    if (canvas.mem)
+        memcpy(p, canvas.mem, size);
+    canvas.mem = p;
+    render_frame(&canvas, array, text_get(message), active, nactive, 1);
+    out.pos += out.headlen + size;
+    video_started = 1;
 }
 
-static float
-font_value(int c, int x, int y)
+static void
+output_finish(void)
 {
-    #include "font.h"
-    if (c < 32 || c > 127)
-        return 0.0f;
-    int cx = c % 16;
-    int cy = (c - 32) / 16;
-    int v = font[(cy * FONT_H + y) * FONT_W * 16 + (cx * FONT_W) + x];
-    return sqrtf(v / 255.0f);
+    if (out.path && !out.opened)
+        output_open(0);
+    #ifdef __linux__
+    if (out.map)
+        munmap(out.map, out.size);
+    #endif
+}
+
+/* Every frame's tone for element i is the same block of samples, so
+ * each is synthesized once, the first time it's needed.
+ */
+static struct {
+    char ready[N];
+    float block[N][HZ / FPS];
+} voice;
+
+static const float *
+voice_block(int i)
+{
+    int nsamples = HZ / FPS;
+    float *v = voice.block[i];
+    if (!voice.ready[i]) {
+        float hz = i * (MAXHZ - MINHZ) / (float)N + MINHZ;
+        for (int j = 0; j < nsamples; j++) {
+            float u = 1.0f - j / (float)(nsamples - 1);
+            float parabola = 1.0f - (u * 2 - 1) * (u * 2 - 1);
+            float envelope = parabola * parabola * parabola;
+            v[j] = sinf(j * 2.0f * PI / HZ * hz) * envelope;
+        }
+        voice.ready[i] = 1;
+    }
+    return v;
 }
 
+/* Spectral synthesis (-i): each frame's voices are binned by pitch and
+ * the whole frame is made by one inverse FFT, so its cost is the same
+ * however many elements were swapped. Tones are rounded to the nearest
+ * bin, about 5.4 Hz apart.
+ */
+#define SPECTRUM 8192  // inverse FFT size, a power of two
+
+static struct {
+    int enabled;
+    short bin[N];
+    float re[SPECTRUM / 2];  // even bins, then IFFT output
+    float im[SPECTRUM / 2];  // odd bins
+    float cos[SPECTRUM / 2];
+    float sin[SPECTRUM / 2];
+    float envelope[HZ / FPS];
+} spectrum;
+
 static void
-ppm_write(const unsigned char *buf, FILE *f)
+spectrum_init(void)
 {
-    fprintf(f, "P6\n%d %d\n255\n", S, S);
-    fwrite(buf, S * 3, S, f);
+    int nsamples = HZ / FPS;
+    for (int i = 0; i < N; i++) {
+        float hz = i * (MAXHZ - MINHZ) / (float)N + MINHZ;
+        spectrum.bin[i] = hz * SPECTRUM / HZ + 0.5f;
+    }
+    for (int i = 0; i < SPECTRUM / 2; i++) {
+        spectrum.cos[i] = cosf(i * 2.0f * PI / SPECTRUM);
+        spectrum.sin[i] = sinf(i * 2.0f * PI / SPECTRUM);
+    }
+    for (int j = 0; j < nsamples; j++) {
+        float u = 1.0f - j / (float)(nsamples - 1);
+        float parabola = 1.0f - (u * 2 - 1) * (u * 2 - 1);
+        spectrum.envelope[j] = parabola * parabola * parabola;
+    }
+    spectrum.enabled = 1;
 }
 
+/* Unnormalized in-place radix-2 inverse FFT of the spectrum buffers, a
+ * complex transform of half the spectrum size.
+ */
 static void
-ppm_set(unsigned char *buf, int x, int y, unsigned long color)
+spectrum_ifft(void)
 {
-    buf[y * S * 3 + x * 3 + 0] = color >> 16;
-    buf[y * S * 3 + x * 3 + 1] = color >>  8;
-    buf[y * S * 3 + x * 3 + 2] = color >>  0;
+    int n = SPECTRUM / 2;
+    float *re = spectrum.re;
+    float *im = spectrum.im;
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j |= bit;
+        if (i < j) {
+            float t;
+            t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len / 2;
+        int step = SPECTRUM / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; k++) {
+                float wr = spectrum.cos[k * step];
+                float wi = spectrum.sin[k * step];
+                int a = i + k;
+                int b = a + half;
+                float xr = re[b] * wr - im[b] * wi;
+                float xi = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - xr;
+                im[b] = im[a] - xi;
+                re[a] += xr;
+                im[a] += xi;
+            }
+        }
+    }
 }
 
-static unsigned long
-ppm_get(unsigned char *buf, int x, int y)
+/* Synthesize the current frame's voices into samples with one inverse
+ * FFT. Sine tones starting at phase zero are the imaginary part of the
+ * transform of the real spectrum X. Packing even bins as the real parts
+ * and odd bins as the imaginary parts of a half-size transform gives
+ * Z = A + iB, where A and B are the transforms of the even and odd bins,
+ * and each output sample is A[j] + w^j B[j].
+ */
+static void
+spectrum_frame(float *samples, const int *counts, const int *touched,
+               int ntouched, int voices)
 {
-    unsigned long r = buf[y * S * 3 + x * 3 + 0];
-    unsigned long g = buf[y * S * 3 + x * 3 + 1];
-    unsigned long b = buf[y * S * 3 + x * 3 + 2];
-    return (r << 16) | (g << 8) | b;
+    int n = SPECTRUM / 2;
+    int nsamples = HZ / FPS;
+    memset(spectrum.re, 0, sizeof(spectrum.re));
+    memset(spectrum.im, 0, sizeof(spectrum.im));
+    for (int k = 0; k < ntouched; k++) {
+        int i = touched[k];
+        int bin = spectrum.bin[i];
+        float *half = bin % 2 ? spectrum.im : spectrum.re;
+        half[bin / 2] += counts[i] / (float)voices;
+    }
+    spectrum_ifft();
+    for (int j = 0; j < nsamples; j++) {
+        int m = (n - j) % n;
+        float zr = spectrum.re[j], zi = spectrum.im[j];
+        float cr = spectrum.re[m], ci = -spectrum.im[m];  // conj(Z[n - j])
+        float ai = (zi + ci) / 2;
+        float br = (zi - ci) / 2;  // B = (Z - conj) / 2i
+        float bi = (cr - zr) / 2;
+        float x = ai + spectrum.sin[j] * br + spectrum.cos[j] * bi;
+        samples[j] = x * spectrum.envelope[j];
+    }
 }
 
+/* Synthesize one frame of 16-bit little endian audio, a tone for each
+ * swapped element. The ntouched elements listed in touched were swapped
+ * the number of times given by counts, which is indexed by element.
+ */
 static void
-ppm_dot(unsigned char *buf, float x, float y, unsigned long fgc)
+audio_frame(unsigned char *pcm, const int *counts, const int *touched,
+            int ntouched)
 {
-    float fr, fg, fb;
-    rgb_split(fgc, &fr, &fg, &fb);
+    int nsamples = HZ / FPS;
+    float samples[HZ / FPS];
+    memset(samples, 0, sizeof(samples));
+
+    /* How many voices to mix? */
+    int voices = 0;
+    for (int k = 0; k < ntouched; k++)
+        voices += counts[touched[k]];
+
+    if (spectrum.enabled) {
+        if (voices)
+            spectrum_frame(samples, counts, touched, ntouched, voices);
+    } else {
+        /* Mix each voice */
+        for (int k = 0; k < ntouched; k++) {
+            int i = touched[k];
+            float w = counts[i] / (float)voices;
+            mix_row(samples, voice_block(i), w, nsamples);
+        }
+    }
 
-    int miny = floorf(y - R1 - 1);
-    int maxy = ceilf(y + R1 + 1);
-    int minx = floorf(x - R1 - 1);
-    int maxx = ceilf(x + R1 + 1);
+    pcm_row(samples, pcm, nsamples);
+}
 
-    for (int py = miny; py <= maxy; py++) {
-        float dy = py - y;
-        for (int px = minx; px <= maxx; px++) {
-            float dx = px - x;
-            float d = sqrtf(dy * dy + dx * dx);
-            float a = smoothstep(R1, R0, d);
+/* Audio thread (-t): the sort thread queues each frame's swap counts
+ * and an audio thread synthesizes and writes the WAV from them, one
+ * block of samples per frame in order, so audio and video costs overlap.
+ * Handing slots back and forth works like the write-behind ring. The WAV
+ * is handed to the thread at the next frame, and handed back when the
+ * thread is stopped so that -a or -i can change between sorts.
+ */
+#define AUDIO_QUEUE 64  // frames of swaps queued ahead of the audio thread
 
-            unsigned long bgc = ppm_get(buf, px, py);
-            float br, bg, bb;
-            rgb_split(bgc, &br, &bg, &bb);
+static struct {
+    int enabled;
+    FILE *wav;  // owned by the audio thread once started
+    unsigned long head;  // next slot to fill, sort thread only
+    unsigned long tail;  // next slot to synthesize, audio thread only
+    struct sema filled;
+    struct sema empty;
+    struct audio_slot {
+        int last;  // no more frames follow
+        int ntouched;
+        int touched[N];
+        int counts[N];
+    } slots[AUDIO_QUEUE];
+    pthread_t thread;
+} audio;
 
-            float r = a * fr + (1 - a) * br;
-            float g = a * fg + (1 - a) * bg;
-            float b = a * fb + (1 - a) * bb;
-            ppm_set(buf, px, py, rgb_join(r, g, b));
+static void *
+audio_thread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        sema_wait(&audio.filled);
+        struct audio_slot *slot = audio.slots + audio.tail++ % AUDIO_QUEUE;
+        if (slot->last)
+            break;
+        unsigned char pcm[AVI_PCM];
+        audio_frame(pcm, slot->counts, slot->touched, slot->ntouched);
+        for (int k = 0; k < slot->ntouched; k++)
+            slot->counts[slot->touched[k]] = 0;
+        fwrite(pcm, sizeof(pcm), 1, audio.wav);
+        if (ferror(audio.wav)) {
+            fputs("sort: error writing audio frame\n", stderr);
+            exit(1);
         }
+        sema_post(&audio.empty);
     }
+    return 0;
 }
 
 static void
-ppm_char(unsigned char *buf, int c, int x, int y, unsigned long fgc)
+audio_start(void)
 {
-    float fr, fg, fb;
-    rgb_split(fgc, &fr, &fg, &fb);
-    for (int dy = 0; dy < FONT_H; dy++) {
-        for (int dx = 0; dx < FONT_W; dx++) {
-            float a = font_value(c, dx, dy);
-            if (a > 0.0f) {
-                unsigned long bgc = ppm_get(buf, x + dx, y + dy);
-                float br, bg, bb;
-                rgb_split(bgc, &br, &bg, &bb);
+    audio.wav = wav;
+    wav = 0;
+    audio.head = audio.tail = 0;
+    memset(audio.slots, 0, sizeof(audio.slots));
+    if (sema_init(&audio.filled, 0) ||
+        sema_init(&audio.empty, AUDIO_QUEUE) ||
+        pthread_create(&audio.thread, 0, audio_thread, 0)) {
+        fputs("sort: could not start audio thread\n", stderr);
+        exit(1);
+    }
+}
 
-                float r = a * fr + (1 - a) * br;
-                float g = a * fg + (1 - a) * bg;
-                float b = a * fb + (1 - a) * bb;
-                ppm_set(buf, x + dx, y + dy, rgb_join(r, g, b));
-            }
-        }
+/* Queue the current frame's swaps for the audio thread. */
+static void
+audio_push(void)
+{
+    sema_wait(&audio.empty);
+    struct audio_slot *slot = audio.slots + audio.head++ % AUDIO_QUEUE;
+    slot->ntouched = nactive;
+    for (int k = 0; k < nactive; k++) {
+        slot->touched[k] = active[k];
+        slot->counts[active[k]] = swaps[active[k]];
     }
+    sema_post(&audio.filled);
 }
 
-static unsigned long
-hue(int v)
+/* Wait for all queued audio to be written, stop the audio thread, and
+ * hand its WAV back to the sort thread.
+ */
+static void
+audio_finish(void)
 {
-    unsigned long h = v / (N / 6);
-    unsigned long f = v % (N / 6);
-    unsigned long t = 0xff * f / (N / 6);
-    unsigned long q = 0xff - t;
-    switch (h) {
-        case 0:
-            return 0xff0000UL | (t << 8);
-        case 1:
-            return (q << 16) | 0x00ff00UL;
-        case 2:
-            return 0x00ff00UL | t;
-        case 3:
-            return (q << 8) | 0x0000ffUL;
-        case 4:
-            return (t << 16) | 0x0000ffUL;
-        case 5:
-            return 0xff0000UL | q;
+    if (!audio.wav)
+        return;
+    sema_wait(&audio.empty);
+    audio.slots[audio.head++ % AUDIO_QUEUE].last = 1;
+    sema_post(&audio.filled);
+    pthread_join(audio.thread, 0);
+    if (fflush(audio.wav)) {
+        fputs("sort: error writing audio frame\n", stderr);
+        exit(1);
     }
-    abort();
+    sema_destroy(&audio.filled);
+    sema_destroy(&audio.empty);
+    wav = audio.wav;
+    audio.wav = 0;
 }
 
-static int array[N];
-static int swaps[N];
-static const char *message;
-static FILE *wav;
+/* Wait for all output to be written. */
+static void
+finish(void)
+{
+    frames_finish();
+    behind_finish();
+    audio_finish();  // only once no video writer can touch wav
+    avi_finish();
+    output_finish();
+}
+
+/* Forget the swaps for the frame just finished. */
+static void
+swaps_clear(void)
+{
+    for (int k = 0; k < nactive; k++)
+        swaps[active[k]] = 0;
+    nactive = 0;
+}
+
+/* Frames outside of [first, last) are skipped without rendering while
+ * the sorts carry on as usual.
+ */
+static unsigned long frame_number;
+static unsigned long frame_first;
+static unsigned long frame_last = -1;
+
+static int audio_only;  // -n: run the sorts for the audio alone
 
 static void
 frame(void)
 {
-    static unsigned char buf[S * S * 3];
-    memset(buf, 0, sizeof(buf));
-    for (int i = 0; i < N; i++) {
-        float delta = abs(i - array[i]) / (N / 2.0f);
-        float x = -sinf(i * 2.0f * PI / N);
-        float y = -cosf(i * 2.0f * PI / N);
-        float r = S * 15.0f / 32.0f * (1.0f - delta);
-        float px = r * x + S / 2.0f;
-        float py = r * y + S / 2.0f;
-        ppm_dot(buf, px, py, hue(array[i]));
-    }
-    if (message)
-        for (int c = 0; message[c]; c++)
-            ppm_char(buf, message[c], c * FONT_W + PAD, PAD, 0xffffffUL);
-    ppm_write(buf, stdout);
-    if (ferror(stdout)) {
-        fputs("sort: error writing video frame\n", stderr);
-        exit(1);
+    unsigned long n = frame_number++;
+    if (n >= frame_last && !dry_run) {
+        finish();
+        exit(EXIT_SUCCESS);
+    }
+    if (n < frame_first || n >= frame_last) {
+        swaps_clear();
+        return;
     }
 
-    /* Output audio */
-    if (wav) {
-        int nsamples = HZ / FPS;
-        static float samples[HZ / FPS];
-        memset(samples, 0, sizeof(samples));
+    if (dry_run) {
+        out.total++;
+        video_started = 1;
+        swaps_clear();
+        return;
+    }
+    if (out.path && !out.opened)
+        output_open(0);
 
-        /* How many voices to mix? */
-        int voices = 0;
-        for (int i = 0; i < N; i++)
-            voices += swaps[i];
-
-        /* Generate each voice */
-        for (int i = 0; i < N; i++) {
-            if (swaps[i]) {
-                float hz = i * (MAXHZ - MINHZ) / (float)N + MINHZ;
-                for (int j = 0; j < nsamples; j++) {
-                    float u = 1.0f - j / (float)(nsamples - 1);
-                    float parabola = 1.0f - (u * 2 - 1) * (u * 2 - 1);
-                    float envelope = parabola * parabola * parabola;
-                    float v = sinf(j * 2.0f * PI / HZ * hz) * envelope;
-                    samples[j] += swaps[i] * v / voices;
-                }
-            }
-        }
+    if (audio.enabled && wav)
+        audio_start();
+    unsigned char pcm[AVI_PCM];
+    if (audio.wav)
+        audio_push();
+    if (wav || avi.enabled)
+        audio_frame(pcm, swaps, active, nactive);
 
-        /* Write out 16-bit samples */
-        for (int i = 0; i < nsamples; i++) {
-            int s = samples[i] * 0x7fff;
-            emit_u16le(s, wav);
-        }
-        if (ferror(wav)) {
-            fputs("sort: error writing audio frame\n", stderr);
-            exit(1);
-        }
+    if (audio_only) {
+        wav_write(wav, pcm);
+        swaps_clear();
+        return;
+    }
+
+    /* A later -b or -p takes over from -l */
+    if (behind.depth && (frames.nworkers || banded))
+        behind_drain();
+
+    int queued = 0;
+    if (out.map) {
+        output_frame();
+    } else if (frames.nworkers) {
+        frames_push(pcm);
+    } else if (banded) {
+        render_banded(array, text_get(message));
+        avi_audio(pcm);
+    } else if (behind.depth) {
+        behind_push(pcm);
+        queued = 1;  // audio is written along with the frame
+    } else if (zerocopy_init()) {
+        zerocopy_write(array, text_get(message));
+        avi_audio(pcm);
+    } else {
+        static struct canvas canvas;
+        render_frame(&canvas, array, text_get(message), active, nactive, 1);
+        video_write(canvas_image(&canvas));
+        avi_audio(pcm);
     }
 
-    memset(swaps, 0, sizeof(swaps));
+    if (!queued)
+        wav_write(wav, pcm);
+
+    swaps_clear();
 }
 
 static void
@@ -276,8 +3090,12 @@ swap(int a[N], int i, int j)
     int tmp = a[i];
     a[i] = a[j];
     a[j] = tmp;
-    swaps[(a - array) + i]++;
-    swaps[(a - array) + j]++;
+    i += a - array;
+    j += a - array;
+    if (!swaps[i]++)
+        active[nactive++] = i;
+    if (!swaps[j]++)
+        active[nactive++] = j;
 }
 
 static void
@@ -328,13 +3146,14 @@ sort_insertion(int array[N])
     }
 }
 
+static int stooge_swaps;  // frames are drawn every 32 swaps
+
 static void
 sort_stoogesort(int *array, int i, int j)
 {
-    static int c = 0;
     if (array[i] > array[j]) {
         swap(array, i, j);
-        if (c++ % 32 == 0)
+        if (stooge_swaps++ % 32 == 0)
             frame();
     }
     if (j - i + 1 > 2) {
@@ -477,7 +3296,7 @@ static FILE *
 wav_init(const char *file)
 {
     FILE *f = fopen(file, "wb");
-    if (f) {
+    if (f && shard.k < 2) {
         emit_u32be(0x52494646UL, f); // "RIFF"
         emit_u32le(0xffffffffUL, f); // file length
         emit_u32be(0x57415645UL, f); // "WAVE"
@@ -498,12 +3317,29 @@ wav_init(const char *file)
 static void
 usage(const char *name, FILE *f)
 {
-    fprintf(f, "usage: %s [-a file] [-h] [-q] [s N] [-w N] [-x HEX] [-y]\n",
-            name);
+    fprintf(f, "usage: %s [-a file] [-b] [-c] [-d] [-f FMT] [-h] [-i] "
+            "[-j N] [-k K/N] [-l N] [-m] [-n] [-o file] [-p N] [-q] "
+            "[-r N:M] [s N] [-t] [-w N] [-x HEX] [-y]\n", name);
     fprintf(f, "  -a       name of audio output (WAV)\n");
+    fprintf(f, "  -b       render and write frames in bands (low memory)\n");
+    fprintf(f, "  -c       render YUV in RGB and convert (exact BT.601)\n");
+    fprintf(f, "  -d       decode a delta stream from standard input\n");
+    fprintf(f, "  -f FMT   video format: ppm (default), y4m, y4m444,\n");
+    fprintf(f, "           headerless rgb24, bgra, nv12, or delta\n");
     fprintf(f, "  -h       print this message\n");
+    fprintf(f, "  -i       synthesize audio by inverse FFT (fixed cost)\n");
+    fprintf(f, "  -j N     render each frame with N threads\n");
+    fprintf(f, "  -k K/N   only output the Kth of N equal parts (from 1)\n");
+    fprintf(f, "  -l N     write frames from a thread, queueing up to N\n");
+    fprintf(f, "  -m       write AVI with interleaved audio "
+            "(bgra, nv12, y4m*)\n");
+    fprintf(f, "  -n       no video, only run the sorts for the audio\n");
+    fprintf(f, "  -o file  write video to file (mapped when possible)\n");
+    fprintf(f, "  -p N     render N frames in parallel\n");
     fprintf(f, "  -q       don't draw the shuffle\n");
+    fprintf(f, "  -r N:M   only output frames N to M - 1 (counting from 0)\n");
     fprintf(f, "  -s N     animate sort number N (see below)\n");
+    fprintf(f, "  -t       synthesize and write audio on its own thread\n");
     fprintf(f, "  -w N     insert a delay of N frames\n");
     fprintf(f, "  -x HEX   use HEX as a 64-bit seed for shuffling\n");
     fprintf(f, "  -y       slow down shuffle animation\n");
@@ -572,27 +3408,27 @@ xgetopt(int argc, char * const argv[], const char *optstring)
     }
 }
 
-int
-main(int argc, char **argv)
-{
-    #ifdef _WIN32
-    /* Set stdin/stdout to binary mode. */
-    int _setmode(int, int);
-    _setmode(1, 0x8000);
-    #endif
-
-    for (int i = 0; i < N; i++)
-        array[i] = i;
+#define OPTIONS "a:bcdf:hij:k:l:mno:p:qr:s:tw:x:y"
 
+/* Process the command line, animating sorts as they're given. */
+static void
+run(int argc, char **argv)
+{
     int sorts = 0;
+    int decode = 0;
+    int ranged = 0;
     unsigned flags = SHUFFLE_DRAW | SHUFFLE_FAST;
     uint64_t seed = 0;
 
     int option;
-    while ((option = xgetopt(argc, argv, "a:hqs:w:x:y")) != -1) {
+    while ((option = xgetopt(argc, argv, OPTIONS)) != -1) {
         int n;
+        char *end;
         switch (option) {
             case 'a':
+                if (dry_run)
+                    break;
+                audio_finish();  // finish the old WAV on the audio thread
                 wav = wav_init(xoptarg);
                 if (!wav) {
                     fprintf(stderr, "%s: %s: %s\n",
@@ -600,18 +3436,137 @@ main(int argc, char **argv)
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 'b':
+                banded = 1;
+                break;
+            case 'c':
+                if (video_started) {
+                    fprintf(stderr, "%s: -c must precede all frames\n",
+                            argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                convert = 1;
+                break;
+            case 'd':
+                decode = 1;
+                break;
+            case 'f':
+                for (n = 0; n < FORMATS_TOTAL; n++)
+                    if (!strcmp(xoptarg, format_names[n]))
+                        break;
+                if (n == FORMATS_TOTAL || video_started) {
+                    fprintf(stderr, "%s: invalid video format: %s\n",
+                            argv[0], xoptarg);
+                    exit(EXIT_FAILURE);
+                }
+                format = n;
+                break;
             case 'h':
                 usage(argv[0], stdout);
                 exit(EXIT_SUCCESS);
+            case 'i':
+                if (!dry_run && !spectrum.enabled) {
+                    audio_finish();  // the audio thread reads spectrum
+                    spectrum_init();
+                }
+                break;
+            case 'j':
+                nthreads = atoi(xoptarg);
+                if (nthreads < 1) {
+                    fprintf(stderr, "%s: invalid thread count: %s\n",
+                            argv[0], xoptarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                shard.k = strtol(xoptarg, &end, 10);
+                shard.n = *end == '/' ? strtol(end + 1, &end, 10) : 0;
+                if (*end || shard.k < 1 || shard.k > shard.n || ranged) {
+                    fprintf(stderr, "%s: invalid shard: %s\n",
+                            argv[0], xoptarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                n = atoi(xoptarg);
+                if (n < 1 || behind.depth || video_started) {
+                    fprintf(stderr, "%s: invalid queue depth: %s\n",
+                            argv[0], xoptarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (!dry_run)
+                    behind_start(n);
+                break;
+            case 'm':
+                if (video_started) {
+                    fprintf(stderr, "%s: -m must precede all frames\n",
+                            argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                if (audio.enabled || audio_only) {
+                    /* AVI needs video, with audio from the sort thread */
+                    fprintf(stderr, "%s: -m cannot be used with -n or -t\n",
+                            argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                avi.enabled = 1;
+                break;
+            case 'n':
+                if (video_started || avi.enabled || out.path) {
+                    fprintf(stderr, "%s: -n must precede all frames and "
+                            "cannot be used with -m or -o\n", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                audio_only = 1;
+                break;
+            case 'o':
+                if (video_started) {
+                    fprintf(stderr, "%s: -o must precede all frames\n",
+                            argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                out.path = xoptarg;
+                break;
+            case 'p':
+                n = atoi(xoptarg);
+                if (n < 1 || frames.nworkers) {
+                    fprintf(stderr, "%s: invalid worker count: %s\n",
+                            argv[0], xoptarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (!dry_run)
+                    frames_start(n);
+                break;
             case 'q':
                 flags &= ~SHUFFLE_DRAW;
                 break;
+            case 'r':
+                frame_first = strtoul(xoptarg, &end, 10);
+                frame_last = -1;
+                if (*end == ':')
+                    frame_last = strtoul(end + 1, &end, 10);
+                if (*end || frame_last <= frame_first || frame_number ||
+                    shard.n) {
+                    fprintf(stderr, "%s: invalid frame range: %s\n",
+                            argv[0], xoptarg);
+                    exit(EXIT_FAILURE);
+                }
+                ranged = 1;
+                break;
             case 's':
                 sorts++;
                 frame();
                 shuffle(array, &seed, flags);
                 run_sort(atoi(xoptarg));
                 break;
+            case 't':
+                if (avi.enabled) {
+                    fprintf(stderr, "%s: -t cannot be used with -m\n",
+                            argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                audio.enabled = 1;
+                break;
             case 'w':
                 n = atoi(xoptarg);
                 for (int i = 0; i < n; i++)
@@ -629,8 +3584,19 @@ main(int argc, char **argv)
         }
     }
 
-    /* If no sorts selected, run all of them in order */
-    if (!sorts) {
+    if (decode) {
+        /* Expand a delta stream instead of animating */
+        if (shard.n) {
+            fprintf(stderr, "%s: -d cannot be sharded\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (dry_run)
+            return;
+        if (out.path)
+            output_open(1);
+        delta_decode(stdin);
+    } else if (!sorts) {
+        /* If no sorts selected, run all of them in order */
         for (int i = 1; i < SORTS_TOTAL; i++) {
             shuffle(array, &seed, flags);
             run_sort(i);
@@ -639,3 +3605,63 @@ main(int argc, char **argv)
         }
     }
 }
+
+int
+main(int argc, char **argv)
+{
+    #ifdef _WIN32
+    /* Set stdin/stdout to binary mode. */
+    int _setmode(int, int);
+    _setmode(0, 0x8000);
+    _setmode(1, 0x8000);
+    #endif
+
+    simd_init();
+    font_init();
+    palette_init();
+    dot_init();
+    layout_init();
+    for (int i = 0; i < N; i++)
+        array[i] = i;
+
+    /* Sizing the -o file or a shard takes a dry run that only counts
+     * frames.
+     */
+    int option;
+    int sharded = 0;
+    xopterr = 0;
+    while ((option = xgetopt(argc, argv, OPTIONS)) != -1 && option != '?') {
+        if (option == 'o')
+            out.path = xoptarg;
+        else if (option == 'k')
+            sharded = 1;
+    }
+    xopterr = 1;
+    xoptind = 0;
+    if (out.path || sharded) {
+        dry_run = 1;
+        run(argc, argv);
+        dry_run = 0;
+        if (shard.n) {
+            /* Contiguous slices of the counted frames, as even as can be */
+            if (avi.enabled || format == FORMAT_DELTA) {
+                fprintf(stderr, "%s: -m and -f delta cannot be sharded\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            frame_first = out.total * (shard.k - 1) / shard.n;
+            frame_last = out.total * shard.k / shard.n;
+            out.total = frame_last - frame_first;
+        }
+        video_started = 0;
+        message = 0;
+        stooge_swaps = 0;
+        frame_number = 0;
+        xoptind = 0;
+        for (int i = 0; i < N; i++)
+            array[i] = i;
+    }
+
+    run(argc, argv);
+    finish();
+}